@@ -0,0 +1,60 @@
+#!/bin/sh
+# replay the standard workloads on generated files of each size and
+# report how long every kind of operation took, see replayRun in scrib.c.
+# BENCH_LINES lists the sizes in lines, BENCH_DIR is where files go.
+# the sizes in BENCH_PIPED are run again with the file read from a pipe,
+# which can't be mapped, so every line is loaded into memory
+set -e
+
+lines=${BENCH_LINES:-"1000 100000 1000000 10000000"}
+piped=${BENCH_PIPED:-"1000 100000 1000000"}
+dir=${BENCH_DIR:-/tmp/scrib-bench}
+mkdir -p "$dir"
+
+# 64 lines pasted in one go
+block=$(awk 'BEGIN { for (i = 0; i < 64; i++) printf "pasted line %d of the block\\r", i }')
+# 100 steps on to the next match
+steps=$(awk 'BEGIN { for (i = 0; i < 100; i++) printf "\\e[C" }')
+
+for n in $lines; do
+	file="$dir/$n.txt"
+	rep="$dir/$n.rep"
+	awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++)
+		printf "line %08d: the quick brown fox jumps over the lazy dog\n", i }' > "$file"
+	rm -f "$dir/.$n.txt.swp"
+
+	# keys as escapes, see replayLoad. the first search moves to the
+	# middle of the file, where the editing happens
+	cat > "$rep" <<END
+size 24 80
+search 1 \x06line $(printf %08d $((n / 2))):\r
+type 2000 x
+enter 200 \r
+backspace 500 \x7f
+paste 20 \e[200~$block\e[201~
+down 2000 \e[B
+pgdn 500 \e[6~
+pgup 500 \e[5~
+search 5 \x06line $(printf %08d $((n - 2))):\r
+step 5 \x06line 0000$steps\r
+miss 3 \x06no line has this\r
+undo 200 \x1a
+redo 200 \x19
+save 3 \x13
+END
+
+	echo "== $n lines"
+	./scrib --replay "$rep" "$file"
+
+	case " $piped " in *" $n "*)
+		fifo="$dir/$n.pipe"
+		rm -f "$fifo"
+		mkfifo "$fifo"
+		cat "$file" > "$fifo" &
+		echo "== $n lines, piped"
+		./scrib --replay "$rep" "$fifo"
+		wait
+		rm -f "$fifo" "$dir/.$n.pipe.swp"
+	esac
+	rm -f "$file" "$rep"
+done
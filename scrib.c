@@ -9,22 +9,81 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCRIB_X86 1
+#endif
+
 /****************************** defines ******************************/
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define SCRIB_VERSION "0.0.1"
 #define SCRIB_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
+#define SCRIB_MSG_SECS 5	//how long a status message stays up
+#define ROW_LEAF_MAX 128	//rows stored in one leaf of the row tree
+#define ROW_NODE_MAX 64		//children of one interior node of the row tree
+#define SCAN_BLOCK (64 * 1024)				//bytes indexed per step when lines are needed
+#define SCAN_MIN_CHUNK (8 * 1024 * 1024)		//smallest slice worth its own thread
+#define SCAN_MAX_CHUNK (1024 * 1024 * 1024)	//keeps newline offsets within 32 bits
+#define SCAN_MAX_THREADS 16
+#define TEXT_SLAB (64 * 1024)	//bytes carved into rows of one size class at a time
+#define TEXT_MAX_CLASS 4096		//longer rows get a malloc of their own
+#define TEXT_CLASSES 32			//size classes up to TEXT_MAX_CLASS, see textClass
+#define TEXT_ARENA (1024 * 1024)	//bytes of loaded text stored in one arena
+#define FRAME_SPAN_GAP 8	//unchanged cells worth resending to skip a cursor move
+#define INPUT_BUF_SIZE 4096	//ring buffer terminal input is read into, power of 2
+#define INPUT_SEQ_WAIT 100	//milliseconds the rest of an escape sequence may take
+#define FRAME_RATE 60	//redraws per second at most, SCRIB_FPS overrides it
+#define FRAME_MAX_LAG 100000	//microseconds keys may be taken for without a redraw
+#define SAVE_IOV 1024	//iovecs handed to one writev when saving
+#define SAVE_TICK 100000000	//nanoseconds between progress updates while saving
+#define JOURNAL_MAGIC "scribjn2"
+#define JOURNAL_SYNC 1	//seconds journal records may wait for an fsync
+#define JOURNAL_BUF (64 * 1024)	//records buffered before they are written anyway
+#define FIND_LONG 32	//queries this long are searched for with memmem
+#define FIND_TASK_ROWS 16384	//rows a search thread takes at a time
+#define FIND_MAX_INDEX (8 * 1024 * 1024)	//matches kept for navigating, the rest are counted
+#define RE_MAX_INS 8192		//instructions a regex may compile to
+#define RE_MAX_REPEAT 1000	//largest count in {m,n}
+#define RE_MAX_STATES 1024	//dfa states kept before they are thrown away
+#define RE_MIN_LITERAL 3	//shortest text worth looking for before running a regex
+#define RE_MAX_LITERAL 64
+#define TRI_CHUNK (256 * 1024)	//bytes of the mapped file each trigram bitmap covers
+#define TRI_LOG_BITS 16		//trigrams are hashed into 2^16 bits a chunk
+#define TRI_WORDS ((1 << TRI_LOG_BITS) / 64)
+#define TRI_SPAN 64		//bytes of a match the bitmap of the chunk it starts in covers
+#define TRI_MIN_MB 64	//smaller files are searched without an index, SCRIB_TRIGRAM_MB overrides it
+#define TRI_MAGIC "scribtr1"
+#define UNDO_MAX_MB 64	//undo history kept at most, SCRIB_UNDO_MB overrides it
+#define PROF_SUB_BITS 4	//profile buckets split each power of two in 16, about 6% apart
+#define PROF_BUCKETS ((64 - PROF_SUB_BITS + 1) << PROF_SUB_BITS)
+#define PROF_DEPTH 8	//phases open inside each other at most
+#define PROF_TRACE_MAX (256 * 1024)	//last phases kept for the trace SCRIB_PROFILE dumps
 
 //for cursor movement
 enum editorKey {
@@ -37,9 +96,60 @@ enum editorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_KEY,	//bracketed paste, the pasted text is in E.paste
+	RESIZE_KEY,	//the terminal changed size
+	TIMER_KEY,	//the event timer went off
+	SAVED_KEY,	//a background save finished
+	FOUND_KEY	//a background search finished
+};
+
+//records of the crash journal, one for each change a row primitive makes
+enum journalOp {
+	JOURNAL_INSERT_ROW = 1,
+	JOURNAL_DEL_ROW,
+	JOURNAL_INSERT,
+	JOURNAL_DELETE
+};
+
+//deltas in the undo history, see undoRecord
+enum undoOpKind {
+	UNDO_INSERT = 1,	//len characters went into row y at 'at'
+	UNDO_DELETE,		//text came out of row y at 'at'
+	UNDO_ROWS_INSERT,	//len rows were inserted from row y on
+	UNDO_ROWS_DELETE	//len rows were deleted at row y, text holds them
+};
+
+//what heap memory is allocated for, see memAlloc
+enum memTag {
+	MEM_TEXT,		//chars of rows that left the mapped file
+	MEM_ROWS,		//nodes of the row tree and the line tables of scanning
+	MEM_FRAME,		//the screen, its shadow and the lines built for it
+	MEM_SEARCH,		//regexes, dfas, the trigram index and match positions
+	MEM_UNDO,		//undo and redo history
+	MEM_JOURNAL,	//journal records waiting to be written
+	MEM_INPUT,		//the last bracketed paste
+	MEM_SAVE,		//rows a save in progress keeps for its snapshot
+	MEM_TAGS
+};
+
+//parts of the main loop that are timed, see profPush
+enum profPhase {
+	PROF_INPUT,		//reading and decoding a key
+	PROF_EDIT,		//handling it
+	PROF_SCROLL,	//editorScroll before a redraw
+	PROF_DRAW,		//building the frame
+	PROF_WRITE,		//diffing it and writing it out
+	PROF_IDLE,		//waiting for something to happen
+	PROF_PHASES
 };
 
+//what the next undo delta starts, or where it goes while undoing
+#define UNDO_BREAK 1	//a step of its own
+#define UNDO_JOIN 2		//a new key, but typing may run on in the last step
+#define UNDO_UNDOING 1	//deltas go to the redo history
+#define UNDO_REDOING 2	//deltas go to the undo history, redo is kept
+
 
 
 
@@ -47,13 +157,175 @@ enum editorKey {
 
 /******************************* data *******************************/
 
+//16 bytes a row, leaves of the row tree hold them side by side. short
+//rows keep their text in the row itself, see editorRowText
 typedef struct erow {
   int size;
-  int rsize;
-  char *chars;
-  char *render;//for rendering tabs
+  unsigned char flags; //ROW_* bits
+  unsigned char cls;   //size class of chars while the row owns them, see textAlloc
+  char text[2];        //where the text of a ROW_INLINE row starts, it runs on over chars
+  char *chars; //tabs are expanded when the row is drawn, see editorDrawRow
 } erow;
 
+//bytes of text a row can hold inline
+#define ROW_INLINE_MAX ((int)(sizeof(erow) - offsetof(erow, text)))
+
+//chars still points into the mapped file and is not NUL terminated
+#define ROW_MAPPED 1
+//chars holds the gap of the row being typed into, see editorRowOpenGap
+#define ROW_GAP 2
+//chars may also be in use by a save snapshot, see rtUnshare
+#define ROW_SHARED 4
+//chars is in an arena of text loaded from a file that could not be
+//mapped. like a mapped row it is only read, see textLoad
+#define ROW_ARENA 8
+//the text is in the row itself and is only read as well. it has no NUL
+#define ROW_INLINE 16
+
+//a slab of row text or an arena of loaded text
+struct textblock {
+	struct textblock *next;
+	char data[];
+};
+
+//where the chars of rows that are not mapped come from, see textAlloc
+struct textpool {
+	char *free[TEXT_CLASSES];	//freed chars of each class, linked through their first bytes
+	char *next[TEXT_CLASSES];	//rest of the slab each class is carving up
+	char *end[TEXT_CLASSES];
+	struct textblock *slabs;
+	struct textblock *arenas;	//newest first, text goes into the first
+	char *arenanext, *arenaend;
+};
+
+//rows live in a counted b-tree so that inserting or deleting a line
+//anywhere in the file costs O(log n) instead of shifting the whole array.
+//every node starts with this header, leaves hold the rows themselves and
+//interior nodes hold children, each knowing how many rows sit below it.
+//a save snapshot shares nodes with the buffer, they are copied on write
+struct rownode {
+	int leaf;       //1 if the node holds rows, 0 if it holds children
+	int n;          //number of rows or children used
+	int count;      //total number of rows in this subtree
+	int ref;        //parents and snapshots pointing at this node
+};
+
+struct rowleaf {
+	struct rownode h;
+	erow row[ROW_LEAF_MAX];
+};
+
+struct rowinner {
+	struct rownode h;
+	struct rownode *child[ROW_NODE_MAX];
+};
+
+//one delta of the undo history, a step is the deltas made by one key
+struct undoOp {
+	int op;         //UNDO_*
+	int y, at;      //row, and column within it
+	size_t len;     //characters or rows inserted or deleted
+	char *text;     //what was deleted, rows each after their length
+	size_t tlen, tcap;
+	int step;       //1 on the first delta of a step
+};
+
+struct undoStack {
+	struct undoOp *op;
+	int n, cap;
+};
+
+//a screenful of character cells and their attributes
+struct frame {
+	int rows;
+	int cols;
+	char *chars;
+	unsigned char *attrs;   //FRAME_* bits per cell
+	int cy, cx;             //where the cursor was left on screen
+	int rowoff;             //file row shown on the first line
+};
+
+#define FRAME_INVERSE 1
+
+//a save running in the background. it writes out a snapshot of the row
+//tree, which shares nodes with the buffer until either side lets go
+struct savejob {
+	struct rownode *root;   //the snapshot
+	int numrows;
+	int from;               //first row written, the ones before are copied
+	size_t prefix;          //bytes copied from the start of the mapped file
+	size_t tailoff;         //start of the part of the map not indexed yet
+	off_t joff;             //journal size then, later records aren't saved
+	char *path;             //file saved to, symlinks resolved
+	int fd;                 //the mapped file when saving in place, else -1
+	int exists;             //the file was there before, with this stat
+	struct stat st;
+	mode_t mode;            //for a new file
+	int dirty;              //E.dirty when the snapshot was taken
+	int threaded;           //writing in its own thread, to be joined
+	pthread_t thread;
+	size_t total;           //bytes the file will have, set by the writer
+	size_t done;            //bytes written so far, read for the status bar
+	int err;                //errno when the save failed, else 0
+	int ownererr;           //errno when the copy couldn't keep the owner
+	erow *freed;            //rows whose chars the buffer dropped in the meantime
+	int nfreed, freedcap;
+};
+
+//one line of a replay script, keys that are sent 'count' times over
+struct replayop {
+	char *label;            //what kind of operation they are, for the report
+	char *keys;
+	size_t len;
+	int count;
+	long long *took;        //microseconds each time took
+	size_t drawn;           //bytes drawn for them, all times together
+};
+
+//a script of keys run through the editor with no terminal, see replayRun
+struct replay {
+	struct replayop *op;
+	int nop, cap;
+	int rows, cols;         //size of the screen it draws
+	const char *next;       //keys of the op being sent not read yet
+	size_t left;
+	char *sink;             //what was drawn, in place of the terminal
+	size_t sinklen, sinkcap;
+	long long open;         //microseconds editorOpen took
+};
+
+//heap bytes held for one memTag
+struct memstat {
+	size_t cur;
+	size_t peak;
+	size_t allocs;	//allocations and reallocations that grew
+};
+
+//a phase that ended, for the trace
+struct profevent {
+	int phase;
+	long long begin;	//nanoseconds since the editor started
+	long long took;		//including the phases inside it
+};
+
+//time spent in each phase, every phase counts only its own time and
+//not that of the phases opened inside it
+struct profile {
+	int show;                 //p50/p99 in the message bar, ctrl-p toggles it
+	int depth;                //phases open, innermost last
+	int phase[PROF_DEPTH];
+	long long begin[PROF_DEPTH];  //when each was opened
+	long long spent[PROF_DEPTH];  //its own time until the one inside it opened
+	long long mark;           //when the innermost one opened or got back control
+	uint64_t hist[PROF_PHASES][PROF_BUCKETS]; //log-linear buckets of nanoseconds
+	uint64_t count[PROF_PHASES];
+	long long max[PROF_PHASES];
+	long long start;          //when the editor started
+	char *path;               //SCRIB_PROFILE, dumped to on exit, or NULL
+	struct profevent *trace;  //ring of the last PROF_TRACE_MAX, with a path
+	size_t ntrace;            //events ever put in it
+};
+
 //to store the size of terminal
 struct editorConfig {
 
@@ -64,11 +336,63 @@ struct editorConfig {
 	int screenrows;
 	int screencols;
 	int numrows;
-	erow *row;      //array of rows to store each row of text in editor
+	struct rownode *rows; //root of the tree holding each row of text in editor
 	int dirty;		//to warn user of unsaved changes
 	char *filename; //to store file name
-	char statusmsg[80];
+	char statusmsg[256];
 	time_t statusmsg_time;
+	char *map;      //file mapped in by editorOpen, unedited rows point into it
+	size_t maplen;
+	size_t mapoff;  //how far into the mapping lines have been indexed
+	int mapfd;      //the mapped file stays open to copy from when saving
+	dev_t mapdev;   //and is told apart from whatever has the same name later
+	ino_t mapino;
+	int dirtyrow;   //rows before this one are still exactly as in the map
+	erow *gaprow;   //row whose chars has a gap at the cursor, NULL if none
+	int gap;        //offset of the gap in gaprow->chars
+	int gaplen;     //bytes in the gap
+	struct textpool text; //chars of rows that are not mapped
+	struct frame frame;  //screen being built by editorRefreshScreen
+	struct frame shadow; //what the terminal is showing right now
+	char inbuf[INPUT_BUF_SIZE]; //bytes read from the terminal but not yet used
+	unsigned inhead;     //next byte to hand out, counts up and wraps with the buffer
+	unsigned intail;     //where the next read stores bytes
+	char *paste;         //text of the last bracketed paste
+	size_t pastelen;
+	int sigfd;           //signalfd SIGWINCH is delivered through
+	int timerfd;         //wakes the editor for status expiry and autosave
+	int autosave;        //seconds a change may go unsaved, 0 for never
+	time_t dirtytime;    //when the buffer last went from saved to modified
+	long long framebudget; //least microseconds between two redraws
+	long long lastframe; //when the last redraw started
+	int syncsave;        //fsync saved files before renaming them into place
+	int inplace;         //save into the mapped file itself rather than a copy
+	struct savejob *save; //save in progress, or NULL
+	int savefd;          //eventfd the save thread signals when it is done
+	char *jpath;         //crash journal of the file, see journalRecord
+	int jfd;             //open journal, -1 while there is none
+	off_t jsize;         //bytes in the journal file
+	char *jbuf;          //records not written to it yet
+	size_t jlen, jcap;
+	time_t jdirty;       //when records were written without an fsync, or 0
+	struct undoStack undo, redo; //history, newest deltas last
+	size_t umem;         //bytes the history takes up
+	size_t umax;         //and may take up
+	int ubreak;          //UNDO_BREAK or UNDO_JOIN before a key's first delta
+	int urec;            //UNDO_UNDOING or UNDO_REDOING while replaying
+	int uskip;           //leave the rest of this step out of the history
+	int utyped;          //the last key typed or deleted a character
+	int findnocase;      //search options, toggled in the search prompt
+	int findword;
+	int findregex;
+	struct findjob *find; //search for every match of the query, or NULL
+	int findfd;          //eventfd its threads signal when they are done
+	struct triindex *tri; //trigrams of the mapped file, or NULL
+	size_t trimin;       //smallest file worth one
+	int tricache;        //keep it beside the file for next time
+	struct replay *replay; //script keys are read from with no terminal, or NULL
+	struct profile prof;   //where the time goes
+	struct memstat mem[MEM_TAGS]; //and the memory
 	struct termios orig_termios;  //to store original terminal attributes
 };
 
@@ -84,9 +408,352 @@ struct editorConfig E;
 
 
 /************************ prototypes *********************/
+void die(const char *s);
 void editorSetStatusMessage(const char *fmt, ...);
+void editorPlaceRow(int at, erow *r);
 void editorRefreshScreen();
+void journalRecord(int op, int y, int at, const char *s, size_t len);
+void undoRecord(int op, int y, int at, const char *s, size_t len);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void findStop();
+void findCancel();
+void triOpen(char *filename, struct stat *st);
+void triStop();
+int editorInputPending(int ms);
+int replayRead(char *buf, int len);
+void replaySink(const char *s, size_t len);
+void replayFail(const char *msg);
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* memory *******************************/
+
+static const char *const memName[MEM_TAGS] = {
+	"text", "rows", "frame", "search", "undo", "journal", "input", "save"
+};
+
+
+//add 'add' and take 'sub' bytes off what a subsystem holds. search and
+//line scanning threads allocate too, so the counts are atomic
+void memCount(int tag, size_t add, size_t sub) {
+	struct memstat *m = &E.mem[tag];
+	size_t cur = __atomic_add_fetch(&m->cur, add - sub, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&m->peak, __ATOMIC_RELAXED);
+	while (cur > peak && !__atomic_compare_exchange_n(&m->peak, &peak, cur, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	if (add > sub)
+		__atomic_add_fetch(&m->allocs, 1, __ATOMIC_RELAXED);
+}
+
+
+//malloc for a subsystem. what malloc really hands out is counted, so
+//the slack of its size classes shows up too
+void *memAlloc(int tag, size_t size) {
+	void *p = malloc(size);
+	if (p)
+		memCount(tag, malloc_usable_size(p), 0);
+	return p;
+}
+
+
+void *memCalloc(int tag, size_t n, size_t size) {
+	void *p = calloc(n, size);
+	if (p)
+		memCount(tag, malloc_usable_size(p), 0);
+	return p;
+}
+
+
+void *memRealloc(int tag, void *p, size_t size) {
+	size_t old = malloc_usable_size(p);
+	void *np = realloc(p, size);
+	if (np)
+		memCount(tag, malloc_usable_size(np), old);
+	return np;
+}
+
+
+void memFree(int tag, void *p) {
+	if (p == NULL)
+		return;
+	memCount(tag, 0, malloc_usable_size(p));
+	free(p);
+}
+
+
+//resident bytes of the whole process, 0 if it can't be told
+size_t memResident() {
+	unsigned long size, resident;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return 0;
+	int ok = fscanf(fp, "%lu %lu", &size, &resident) == 2;
+	fclose(fp);
+	return ok ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+
+//bytes in a short human form
+void memFormat(char *buf, size_t len, size_t n) {
+	if (n < 1024)
+		snprintf(buf, len, "%zu", n);
+	else if (n < 1024 * 1024)
+		snprintf(buf, len, "%.1fK", n / 1024.0);
+	else if (n < 1024 * 1024 * 1024)
+		snprintf(buf, len, "%.1fM", n / (1024.0 * 1024));
+	else
+		snprintf(buf, len, "%.2fG", n / (1024.0 * 1024 * 1024));
+}
+
+
+//what each subsystem holds now and at most, for the status message
+void memReport(char *buf, size_t len) {
+	char cur[16], peak[16];
+	int n = snprintf(buf, len, "mem now/peak:");
+	for (int i = 0; i < MEM_TAGS && n < (int)len; i++) {
+		memFormat(cur, sizeof(cur), E.mem[i].cur);
+		memFormat(peak, sizeof(peak), E.mem[i].peak);
+		n += snprintf(buf + n, len - n, " %s %s/%s", memName[i], cur, peak);
+	}
+	if (n < (int)len) {
+		memFormat(cur, sizeof(cur), E.maplen);
+		memFormat(peak, sizeof(peak), memResident());
+		snprintf(buf + n, len - n, " | mapped %s rss %s", cur, peak);
+	}
+}
+
+
+//the same as JSON, for scripts. the mapped file is file backed and
+//counted apart from the heap, rss is everything the process has in memory
+void memDump(FILE *fp) {
+	fprintf(fp, "{\"rss\":%zu,\"mapped\":%zu,\"tags\":{", memResident(), E.maplen);
+	for (int i = 0; i < MEM_TAGS; i++)
+		fprintf(fp, "%s\"%s\":{\"current\":%zu,\"peak\":%zu,\"allocs\":%zu}", i ? "," : "",
+			memName[i], E.mem[i].cur, E.mem[i].peak, E.mem[i].allocs);
+	fprintf(fp, "}}\n");
+}
+
+
+//write memDump to SCRIB_MEMSTAT, if it is set
+void memDumpFile() {
+	char *path = getenv("SCRIB_MEMSTAT");
+	if (path == NULL || *path == '\0')
+		return;
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+		return;
+	memDump(fp);
+	fclose(fp);
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* profiling *******************************/
+
+static const char *const profName[PROF_PHASES] = {
+	"input", "edit", "scroll", "draw", "write", "idle"
+};
+
+
+//nanoseconds on a clock that only goes forward
+long long profNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+//bucket 'ns' falls in. below 2^PROF_SUB_BITS each value has its own,
+//above it every power of two is split in 2^PROF_SUB_BITS equal parts,
+//so a bucket is never wider than about 6% of what it holds
+int profBucket(long long ns) {
+	unsigned long long v = ns > 0 ? ns : 0;
+	if (v < (1 << PROF_SUB_BITS))
+		return v;
+	int e = 63 - __builtin_clzll(v);
+	int sub = (v >> (e - PROF_SUB_BITS)) & ((1 << PROF_SUB_BITS) - 1);
+	return ((e - PROF_SUB_BITS + 1) << PROF_SUB_BITS) | sub;
+}
+
+
+//smallest value that goes in bucket b
+long long profBucketLow(int b) {
+	if (b < (1 << PROF_SUB_BITS))
+		return b;
+	int e = (b >> PROF_SUB_BITS) + PROF_SUB_BITS - 1;
+	long long sub = b & ((1 << PROF_SUB_BITS) - 1);
+	return ((1LL << PROF_SUB_BITS) + sub) << (e - PROF_SUB_BITS);
+}
+
+
+//time a phase of its own until the matching profPop. the phase it
+//is opened in stops counting meanwhile
+void profPush(int phase) {
+	struct profile *P = &E.prof;
+	long long now = profNow();
+	if (P->depth > 0 && P->depth <= PROF_DEPTH)
+		P->spent[P->depth - 1] += now - P->mark;
+	if (P->depth < PROF_DEPTH) {
+		P->phase[P->depth] = phase;
+		P->begin[P->depth] = now;
+		P->spent[P->depth] = 0;
+	}
+	P->depth++;	//counted past PROF_DEPTH too, for the pops to match
+	P->mark = now;
+}
+
+
+//close the innermost phase and add its own time to its histogram
+void profPop() {
+	struct profile *P = &E.prof;
+	long long now = profNow();
+	if (P->depth == 0 || --P->depth >= PROF_DEPTH)
+		return;
+	int phase = P->phase[P->depth];
+	long long took = P->spent[P->depth] + now - P->mark;
+	P->hist[phase][profBucket(took)]++;
+	P->count[phase]++;
+	if (took > P->max[phase])
+		P->max[phase] = took;
+	if (P->trace) {
+		struct profevent *ev = &P->trace[P->ntrace++ % PROF_TRACE_MAX];
+		ev->phase = phase;
+		ev->begin = P->begin[P->depth] - P->start;
+		ev->took = now - P->begin[P->depth];
+	}
+	P->mark = now;
+}
+
+
+//time below which a fraction 'q' of the phase's samples fall, to
+//within a bucket, 0 when it has none
+long long profPercentile(int phase, double q) {
+	struct profile *P = &E.prof;
+	double want = q * P->count[phase];
+	uint64_t rank = (uint64_t)want;
+	if (rank < want)
+		rank++;
+	if (rank == 0)
+		return 0;
+	uint64_t seen = 0;
+	for (int b = 0; b < PROF_BUCKETS; b++) {
+		seen += P->hist[phase][b];
+		if (seen >= rank && b + 1 < PROF_BUCKETS) {
+			long long mid = (profBucketLow(b) + profBucketLow(b + 1)) / 2;
+			return mid < P->max[phase] ? mid : P->max[phase];
+		}
+	}
+	return P->max[phase];
+}
+
+
+//nanoseconds as a short number of microseconds or milliseconds
+void profFormat(char *buf, size_t size, long long ns) {
+	if (ns < 10000)
+		snprintf(buf, size, "%.1f", ns / 1000.0);
+	else if (ns < 10000000)
+		snprintf(buf, size, "%lld", ns / 1000);
+	else
+		snprintf(buf, size, "%lldms", ns / 1000000);
+}
+
+
+//the overlay the message bar shows instead of the status message
+int profOverlay(char *buf, size_t size) {
+	int len = snprintf(buf, size, "p50/p99 us:");
+	for (int i = 0; i < PROF_IDLE && len < (int)size; i++) {
+		char p50[16], p99[16];
+		profFormat(p50, sizeof(p50), profPercentile(i, 0.50));
+		profFormat(p99, sizeof(p99), profPercentile(i, 0.99));
+		len += snprintf(buf + len, size - len, " %s %s/%s", profName[i], p50, p99);
+	}
+	return len < (int)size ? len : (int)size - 1;
+}
+
+
+//write the histograms to SCRIB_PROFILE.hist and the phases of the
+//trace to SCRIB_PROFILE.json, which chrome://tracing and perfetto open
+void profDump() {
+	struct profile *P = &E.prof;
+	size_t len = strlen(P->path) + 6;
+	char *name = malloc(len);
+	if (!name)
+		return;
+
+	snprintf(name, len, "%s.hist", P->path);
+	FILE *fp = fopen(name, "w");
+	if (fp) {
+		fprintf(fp, "%-8s %10s %10s %10s %10s %10s %10s\n", "phase", "count",
+			"p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+		for (int i = 0; i < PROF_PHASES; i++)
+			fprintf(fp, "%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", profName[i],
+				(unsigned long long)P->count[i], profPercentile(i, 0.50) / 1000.0,
+				profPercentile(i, 0.90) / 1000.0, profPercentile(i, 0.99) / 1000.0,
+				profPercentile(i, 0.999) / 1000.0, P->max[i] / 1000.0);
+		//the buckets themselves, so other percentiles can be had later
+		fprintf(fp, "\n%-8s %14s %10s\n", "phase", "from_ns", "count");
+		for (int i = 0; i < PROF_PHASES; i++)
+			for (int b = 0; b < PROF_BUCKETS; b++)
+				if (P->hist[i][b])
+					fprintf(fp, "%-8s %14lld %10llu\n", profName[i], profBucketLow(b),
+						(unsigned long long)P->hist[i][b]);
+		fclose(fp);
+	}
+
+	snprintf(name, len, "%s.json", P->path);
+	fp = fopen(name, "w");
+	if (fp) {
+		size_t n = P->ntrace < PROF_TRACE_MAX ? P->ntrace : PROF_TRACE_MAX;
+		fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+		for (size_t k = 0; k < n; k++) {
+			struct profevent *ev = &P->trace[(P->ntrace - n + k) % PROF_TRACE_MAX];
+			fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+				"\"ts\":%.3f,\"dur\":%.3f}", k ? "," : "", profName[ev->phase],
+				ev->begin / 1000.0, ev->took / 1000.0);
+		}
+		fprintf(fp, "\n]}\n");
+		fclose(fp);
+	}
+	free(name);
+}
+
+
+//start timing, and with SCRIB_PROFILE set keep a trace to dump on exit
+void profInit() {
+	struct profile *P = &E.prof;
+	memset(P, 0, sizeof(*P));
+	P->start = profNow();
+	P->path = getenv("SCRIB_PROFILE");
+	if (P->path && *P->path) {
+		P->trace = malloc(PROF_TRACE_MAX * sizeof(struct profevent));
+		if (!P->trace)
+			die("malloc");
+		atexit(profDump);
+	} else {
+		P->path = NULL;
+	}
+}
 
 
 
@@ -102,12 +769,20 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 /******************************* terminal *******************************/
 
+//send output to the terminal, or to the sink of a replay that has none
+void editorWrite(const char *s, size_t len) {
+	if (E.replay)
+		replaySink(s, len);
+	else
+		write(STDOUT_FILENO, s, len);
+}
+
 //error handling - errno variable stores the error
 void die(const char *s) {
 
 	//clear the screen on exit
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-	write(STDOUT_FILENO, "\x1b[H", 3);
+	editorWrite("\x1b[2J", 4);
+	editorWrite("\x1b[H", 3);
 
 	perror(s);//to print out decriptive error message with tag 's' passed on to the function die
 	exit(1);
@@ -120,6 +795,8 @@ void disableRawMode() {
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
 		die("tcsetattr");
 
+	//stop the terminal from marking pasted text
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 }
 void enableRawMode() {
 
@@ -149,44 +826,250 @@ void enableRawMode() {
 	//IEXTEN  to disable ctrl-V and ctrl-O
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 	raw.c_cc[VMIN] = 0;  //min bytes to read before read() returns
-	raw.c_cc[VTIME] = 1; //min time to wait before read() returns
+	raw.c_cc[VTIME] = 0; //read() never waits, waiting is done in poll
 
 	//enable raw mode
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) 
 		die("tcsetattr");
+
+	//ask for bracketed paste, pasted text then arrives between
+	//ESC[200~ and ESC[201~ and can be inserted in one go
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+
+//get the next byte of terminal input into 'c', reading as much as is
+//available into the ring buffer whenever it runs empty. returns 0 if
+//nothing has arrived, the read doesn't wait
+int editorReadByte(char *c) {
+	if (E.inhead == E.intail) {
+		unsigned at = E.intail % INPUT_BUF_SIZE;
+		//the buffer is empty, so it can be filled up to its end
+		int nread = E.replay ? replayRead(&E.inbuf[at], INPUT_BUF_SIZE - at) :
+					read(STDIN_FILENO, &E.inbuf[at], INPUT_BUF_SIZE - at);
+		if (nread == -1 && errno != EAGAIN)
+			die("read");
+		if (nread <= 0)
+			return 0;
+		E.intail += nread;
+	}
+	*c = E.inbuf[E.inhead++ % INPUT_BUF_SIZE];
+	return 1;
+}
+
+
+//get the next byte of a sequence that has started, giving it up to 'ms'
+//milliseconds to arrive, -1 waits for as long as it takes. a replay has
+//all its keys at hand, so there is nothing to wait for
+int editorReadByteWait(char *c, int ms) {
+	if (editorReadByte(c))
+		return 1;
+	if (E.replay)
+		return 0;
+	while (editorInputPending(ms))
+		if (editorReadByte(c))
+			return 1;
+	return 0;
+}
+
+
+//collect a bracketed paste into E.paste, up to the closing ESC[201~
+int editorReadPaste() {
+	static const char end[] = "\x1b[201~";
+	size_t cap = E.paste ? E.pastelen : 0;
+	size_t len = 0;
+	char c;
+
+	while (1) {
+		if (editorReadByteWait(&c, -1) != 1) {
+			if (E.replay)
+				replayFail("a paste never ends");
+			continue;
+		}
+		if (len == cap) {
+			cap = cap ? cap * 2 : 4096;
+			E.paste = memRealloc(MEM_INPUT, E.paste, cap);
+			if (E.paste == NULL) die("realloc");
+		}
+		E.paste[len++] = c;
+		if (len >= sizeof(end) - 1 &&
+			memcmp(&E.paste[len - (sizeof(end) - 1)], end, sizeof(end) - 1) == 0)
+			break;
+	}
+	E.pastelen = len - (sizeof(end) - 1);
+	return PASTE_KEY;
+}
+
+
+//set up the descriptors the editor waits on besides the terminal,
+//SIGWINCH is blocked and read from a signalfd instead
+void editorInitEvents() {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		die("sigprocmask");
+	E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (E.sigfd == -1)
+		die("signalfd");
+	E.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (E.timerfd == -1)
+		die("timerfd_create");
+	E.savefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (E.savefd == -1)
+		die("eventfd");
+	E.findfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (E.findfd == -1)
+		die("eventfd");
+
+	char *autosave = getenv("SCRIB_AUTOSAVE");
+	E.autosave = autosave ? atoi(autosave) : 0;
+}
+
+
+//arm the timer for whichever comes first, the status message going
+//stale, an autosave or a journal fsync falling due. with none of them
+//it stays disarmed
+void editorArmTimer() {
+	struct itimerspec its;
+	time_t now = time(NULL);
+	time_t next = 0;
+
+	memset(&its, 0, sizeof(its));
+	if (E.statusmsg[0] && now - E.statusmsg_time < SCRIB_MSG_SECS)
+		next = E.statusmsg_time + SCRIB_MSG_SECS;
+	if (E.autosave > 0 && E.dirty && E.filename) {
+		if (E.dirtytime == 0)
+			E.dirtytime = now;
+		if (next == 0 || E.dirtytime + E.autosave < next)
+			next = E.dirtytime + E.autosave;
+	} else {
+		E.dirtytime = 0;
+	}
+	if (E.jdirty && (next == 0 || E.jdirty + JOURNAL_SYNC < next))
+		next = E.jdirty + JOURNAL_SYNC;
+
+	if (next > now)
+		its.it_value.tv_sec = next - now;
+	else if (next)
+		its.it_value.tv_nsec = 1;	//already due
+	if (E.save && (next == 0 || next > now)) {	//tick while showing save progress
+		its.it_value.tv_sec = 0;
+		its.it_value.tv_nsec = SAVE_TICK;
+	}
+	if (timerfd_settime(E.timerfd, 0, &its, NULL) == -1)
+		die("timerfd_settime");
+}
+
+
+//microseconds on a clock that only goes forward
+long long editorNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+//is there terminal input within 'ms' milliseconds
+int editorInputPending(int ms) {
+	if (E.inhead != E.intail)
+		return 1;
+	struct pollfd pfd;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, ms) > 0 && (pfd.revents & POLLIN);
+}
+
+
+//sleep until something happens. returns 0 once there is terminal input,
+//or RESIZE_KEY, TIMER_KEY, SAVED_KEY or FOUND_KEY for the other event sources
+int editorWaitEvent() {
+	struct pollfd fds[5];
+	fds[0].fd = STDIN_FILENO;
+	fds[1].fd = E.sigfd;
+	fds[2].fd = E.timerfd;
+	fds[3].fd = E.savefd;
+	fds[4].fd = E.findfd;
+	fds[0].events = fds[1].events = fds[2].events = fds[3].events = POLLIN;
+	fds[4].events = POLLIN;
+
+	//a replay has sent all the keys there are
+	if (E.replay)
+		replayFail("keys ran out before it was done");
+	editorArmTimer();
+	profPush(PROF_IDLE);
+	while (poll(fds, 5, -1) == -1) {
+		if (errno != EINTR)
+			die("poll");
+	}
+	profPop();
+
+	if (fds[1].revents & POLLIN) {
+		struct signalfd_siginfo si;
+		while (read(E.sigfd, &si, sizeof(si)) == sizeof(si))
+			;
+		return RESIZE_KEY;
+	}
+	if (fds[2].revents & POLLIN) {
+		uint64_t expirations;
+		if (read(E.timerfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+			die("read");
+		return TIMER_KEY;
+	}
+	if (fds[3].revents & POLLIN) {
+		uint64_t count;
+		if (read(E.savefd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+			die("read");
+		return SAVED_KEY;
+	}
+	if (fds[4].revents & POLLIN)	//findCollect takes the wake-up
+		return FOUND_KEY;
+	return 0;
 }
 
 
 //read a character from terminal and return it
 int editorReadKey() {
-	int nread;
 	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-	  if (nread == -1 && errno != EAGAIN) 
-		die("read");
+	//with nothing buffered go straight to poll, which watches the other
+	//event sources too. a replay fills the buffer from its script
+	int ready = E.inhead != E.intail || E.replay;
+	while (!ready || editorReadByte(&c) != 1) {
+		int event = editorWaitEvent();
+		if (event)
+			return event;
+		ready = 1;
 	}
 
 	//checking for escape sequences
 	if (c == '\x1b') {
 		char seq[3];
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		if (editorReadByteWait(&seq[0], INPUT_SEQ_WAIT) != 1) return '\x1b';
+		if (editorReadByteWait(&seq[1], INPUT_SEQ_WAIT) != 1) return '\x1b';
 
 		//checkingfor arrow keys, pageup/pagedn etc as they begin with [
 		if (seq[0] == '[') {
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) 
-					return '\x1b';
+				//numbered keys end with '~', the number can have several digits
+				int num = seq[1] - '0';
+				while (1) {
+					if (editorReadByteWait(&seq[2], INPUT_SEQ_WAIT) != 1) 
+						return '\x1b';
+					if (seq[2] < '0' || seq[2] > '9')
+						break;
+					num = num * 10 + seq[2] - '0';
+				}
 				if (seq[2] == '~') {
-					//check second char of input seq for page_up, page_down,home,end
-					switch (seq[1]) {
-						case '1': return HOME_KEY;
-						case '3': return DEL_KEY;
-						case '4': return END_KEY;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME_KEY;
-						case '8': return END_KEY;
+					//check the number for page_up, page_down,home,end
+					switch (num) {
+						case 1: return HOME_KEY;
+						case 3: return DEL_KEY;
+						case 4: return END_KEY;
+						case 5: return PAGE_UP;
+						case 6: return PAGE_DOWN;
+						case 7: return HOME_KEY;
+						case 8: return END_KEY;
+						case 200: return editorReadPaste();
 					}
 				}
 			} else {
@@ -223,7 +1106,7 @@ int getCursorPosition(int *rows, int *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   while (i < sizeof(buf) - 1) {
-	if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+	if (editorReadByteWait(&buf[i], INPUT_SEQ_WAIT) != 1) break;
 	if (buf[i] == 'R') break;
 	i++;
   }
@@ -237,6 +1120,11 @@ int getCursorPosition(int *rows, int *cols) {
 //get size of terminal, stores the rows and coloumn size of terminal in 'ws'
 int getWindowSize(int *rows, int *cols) {
 	struct winsize ws;
+	if (E.replay) {
+		*rows = E.replay->rows;
+		*cols = E.replay->cols;
+		return 0;
+	}
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
 		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) 
 			return -1;
@@ -259,129 +1147,889 @@ int getWindowSize(int *rows, int *cols) {
 
 
 
-/******************************* row operations *****************/
 
-//for rendering tabs, converting cx to rx
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-	if (row->chars[j] == '\t')
-	  rx += (SCRIB_TAB_STOP - 1) - (rx % SCRIB_TAB_STOP);
-	rx++;
-  }
-  return rx;
+/******************************* row tree *******************************/
+
+struct rownode *rtNewNode(int leaf) {
+	struct rownode *nd = memAlloc(MEM_ROWS, leaf ? sizeof(struct rowleaf) :
+												 sizeof(struct rowinner));
+	if (nd == NULL) die("malloc");
+	nd->leaf = leaf;
+	nd->n = 0;
+	nd->count = 0;
+	nd->ref = 1;
+	return nd;
 }
 
+//get a node that is shared with a snapshot out of the way before it is
+//changed: the node in 'slot' is replaced by a private copy. rows in a
+//copied leaf are marked, their chars are copied before they change
+struct rownode *rtUnshare(struct rownode **slot) {
+	struct rownode *nd = *slot;
+	if (nd->ref == 1)
+		return nd;
 
-//for rendering tabs, converting rx to cx
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (SCRIB_TAB_STOP - 1) - (cur_rx % SCRIB_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
-  }
-  return cx;
+	struct rownode *cp = rtNewNode(nd->leaf);
+	int j;
+	if (nd->leaf) {
+		struct rowleaf *lf = (struct rowleaf *)cp;
+		memcpy(lf, nd, sizeof(struct rowleaf));
+		for (j = 0; j < cp->n; j++)
+			if (!(lf->row[j].flags & (ROW_MAPPED | ROW_ARENA | ROW_INLINE)))
+				lf->row[j].flags |= ROW_SHARED;
+	} else {
+		struct rowinner *in = (struct rowinner *)cp;
+		memcpy(in, nd, sizeof(struct rowinner));
+		for (j = 0; j < cp->n; j++)
+			in->child[j]->ref++;
+	}
+	cp->ref = 1;
+	nd->ref--;
+	*slot = cp;
+	return cp;
 }
 
+//drop one reference to a subtree, freeing the nodes nobody else holds.
+//the chars of the rows are left alone, the buffer owns those
+void rtRelease(struct rownode *nd) {
+	if (--nd->ref > 0)
+		return;
+	if (!nd->leaf) {
+		struct rowinner *in = (struct rowinner *)nd;
+		int j;
+		for (j = 0; j < nd->n; j++)
+			rtRelease(in->child[j]);
+	}
+	memFree(MEM_ROWS, nd);
+}
+
+//base address and element size of the rows or children held by a node
+char *rtItems(struct rownode *nd, size_t *size) {
+	if (nd->leaf) {
+		*size = sizeof(erow);
+		return (char *)((struct rowleaf *)nd)->row;
+	}
+	*size = sizeof(struct rownode *);
+	return (char *)((struct rowinner *)nd)->child;
+}
 
-//for rendering tabs
-void editorUpdateRow(erow *row) {
-	int tabs = 0;
+//recompute the number of rows below a node from its direct children
+void rtRecount(struct rownode *nd) {
+	if (nd->leaf) {
+		nd->count = nd->n;
+		return;
+	}
+	struct rowinner *in = (struct rowinner *)nd;
 	int j;
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t') tabs++;
-	free(row->render);
-	row->render = malloc(row->size + tabs*(SCRIB_TAB_STOP-1) + 1);
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % SCRIB_TAB_STOP != 0) row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
+	nd->count = 0;
+	for (j = 0; j < nd->n; j++)
+		nd->count += in->child[j]->count;
+}
+
+//find the leaf of tree 'nd' holding row 'at' and the index of the row inside it
+struct rowleaf *rtFind(struct rownode *nd, int at, int *idx) {
+	while (!nd->leaf) {
+		struct rowinner *in = (struct rowinner *)nd;
+		int i = 0;
+		while (i < nd->n - 1 && at >= in->child[i]->count) {
+			at -= in->child[i]->count;
+			i++;
 		}
+		nd = in->child[i];
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	*idx = at;
+	return (struct rowleaf *)nd;
 }
 
+//make room for one item at 'at' in a node, splitting it in two when full.
+//returns the node the item has to go into and updates 'at' to match,
+//the split-off right half (if any) is stored in 'split'
+struct rownode *rtMakeRoom(struct rownode *nd, int *at, struct rownode **split) {
+	int max = nd->leaf ? ROW_LEAF_MAX : ROW_NODE_MAX;
+	size_t size;
+	char *items = rtItems(nd, &size);
+
+	*split = NULL;
+	if (nd->n == max) {
+		//appending to a full node only moves the new item across, so a file
+		//loaded line by line ends up packed into full leaves
+		int half = (*at == max) ? max : max / 2;
+		struct rownode *sp = rtNewNode(nd->leaf);
+		size_t spsize;
+		char *spitems = rtItems(sp, &spsize);
+
+		sp->n = nd->n - half;
+		memcpy(spitems, items + half * size, sp->n * size);
+		nd->n = half;
+		rtRecount(nd);
+		rtRecount(sp);
+		*split = sp;
+		if (*at > half || half == max) {
+			*at -= half;
+			nd = sp;
+			items = spitems;
+		}
+	}
+	memmove(items + (*at + 1) * size, items + *at * size, (nd->n - *at) * size);
+	nd->n++;
+	return nd;
+}
 
+//insert row 'r' at position 'at' of the subtree,
+//returns the new right sibling if the node had to be split
+struct rownode *rtInsert(struct rownode *nd, int at, erow *r) {
+	struct rownode *split;
 
+	if (nd->leaf) {
+		struct rownode *dst = rtMakeRoom(nd, &at, &split);
+		((struct rowleaf *)dst)->row[at] = *r;
+		dst->count++;
+		return split;
+	}
 
-//add the line read from input file into a newly created row 
-void editorInsertRow(int at, char *s, size_t len) {
-
-  	if (at < 0 || at > E.numrows) return;
-  	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	struct rowinner *in = (struct rowinner *)nd;
+	int i = 0;
+	if (at == nd->count) {	//appending, as when a file is loaded
+		i = nd->n - 1;
+		at = in->child[i]->count;
+	}
+	while (i < nd->n - 1 && at > in->child[i]->count) {
+		at -= in->child[i]->count;
+		i++;
+	}
+	struct rownode *sib = rtInsert(rtUnshare(&in->child[i]), at, r);
+	nd->count++;
+	if (sib == NULL)
+		return NULL;
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+	//hook the split-off child in right after the one it came from
+	i++;
+	struct rownode *dst = rtMakeRoom(nd, &i, &split);
+	((struct rowinner *)dst)->child[i] = sib;
+	rtRecount(dst);
+	return split;
+}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editorUpdateRow(&E.row[at]);
+//fix up child 'i' of an interior node after it dropped below half full,
+//either merging it with a neighbour or evening out the two of them
+void rtRebalance(struct rowinner *in, int i) {
+	if (in->h.n < 2)
+		return;
+	if (i == in->h.n - 1)
+		i--;
+
+	struct rownode *a = rtUnshare(&in->child[i]);
+	struct rownode *b = rtUnshare(&in->child[i + 1]);
+	int max = a->leaf ? ROW_LEAF_MAX : ROW_NODE_MAX;
+	int total = a->n + b->n;
+	size_t size;
+	char *aitems = rtItems(a, &size);
+	char *bitems = rtItems(b, &size);
+
+	if (total <= max) {
+		memcpy(aitems + a->n * size, bitems, b->n * size);
+		a->n = total;
+		rtRecount(a);
+		memFree(MEM_ROWS, b);
+		memmove(&in->child[i + 1], &in->child[i + 2],
+				sizeof(struct rownode *) * (in->h.n - i - 2));
+		in->h.n--;
+		return;
+	}
 
-	E.numrows++;
-	E.dirty++;	//increment when changes are made
+	int target = total / 2;
+	if (a->n < target) {
+		int k = target - a->n;
+		memcpy(aitems + a->n * size, bitems, k * size);
+		memmove(bitems, bitems + k * size, (b->n - k) * size);
+		a->n += k;
+		b->n -= k;
+	} else {
+		int k = a->n - target;
+		memmove(bitems + k * size, bitems, b->n * size);
+		memcpy(bitems, aitems + target * size, k * size);
+		a->n -= k;
+		b->n += k;
+	}
+	rtRecount(a);
+	rtRecount(b);
 }
 
+//remove row 'at' from the subtree, the caller frees what the row owned
+void rtDelete(struct rownode *nd, int at) {
+	if (nd->leaf) {
+		struct rowleaf *lf = (struct rowleaf *)nd;
+		memmove(&lf->row[at], &lf->row[at + 1], sizeof(erow) * (nd->n - at - 1));
+		nd->n--;
+		nd->count--;
+		return;
+	}
 
-//free memory assigned to a row qhen row is deleted
-void editorFreeRow(erow *row) {
-  	free(row->render);
-  	free(row->chars);
+	struct rowinner *in = (struct rowinner *)nd;
+	int i = 0;
+	while (i < nd->n - 1 && at >= in->child[i]->count) {
+		at -= in->child[i]->count;
+		i++;
+	}
+	rtDelete(rtUnshare(&in->child[i]), at);
+	nd->count--;
+
+	int max = in->child[i]->leaf ? ROW_LEAF_MAX : ROW_NODE_MAX;
+	if (in->child[i]->n < max / 2)
+		rtRebalance(in, i);
 }
 
-//deleting a row when del key is pressed at the beginning of a row
-void editorDelRow(int at) {
-  	
-  	//if cursor is at eof, no need to delete any row
-  	if (at < 0 || at >= E.numrows) 
-  		return;
-  	editorFreeRow(&E.row[at]);
-  	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  	E.numrows--;
-  	E.dirty++;
+//pointer to row 'at' of the file
+erow *editorRowAt(int at) {
+	int idx;
+	struct rowleaf *lf = rtFind(E.rows, at, &idx);
+	return &lf->row[idx];
 }
 
+//pointer to row 'at' and the number of rows stored right after it in the
+//same leaf, lets callers walk the file one chunk at a time
+int editorRowSpan(int at, erow **rows) {
+	int idx;
+	struct rowleaf *lf = rtFind(E.rows, at, &idx);
+	*rows = &lf->row[idx];
+	return lf->h.n - idx;
+}
 
-//insert a character into a particular position in a row
-void editorRowInsertChar(erow *row, int at, int c) {
-	if (at < 0 || at > row->size) 
-			at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+//like editorRowAt, but the nodes on the way down are unshared first so
+//that the row can be changed without a snapshot seeing it
+erow *rtRowMutable(int at) {
+	struct rownode *nd = rtUnshare(&E.rows);
+	while (!nd->leaf) {
+		struct rowinner *in = (struct rowinner *)nd;
+		int i = 0;
+		while (i < nd->n - 1 && at >= in->child[i]->count) {
+			at -= in->child[i]->count;
+			i++;
+		}
+		nd = rtUnshare(&in->child[i]);
+	}
+	return &((struct rowleaf *)nd)->row[at];
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* line scanning *******************************/
+
+//offsets of the newlines found in one chunk of the mapped file
+struct linetab {
+	uint32_t *off;
+	size_t n;
+	size_t cap;
+};
+
+void ltPush(struct linetab *lt, size_t off) {
+	if (lt->n == lt->cap) {
+		lt->cap = lt->cap ? lt->cap * 2 : 1024;
+		lt->off = memRealloc(MEM_ROWS, lt->off, sizeof(uint32_t) * lt->cap);
+		if (lt->off == NULL) die("realloc");
+	}
+	lt->off[lt->n++] = off;
+}
+
+//plain fallback, also used for the tail the vector loops leave behind
+void lineScanScalar(struct linetab *lt, const char *buf, size_t from, size_t len) {
+	const char *p = buf + from;
+	const char *end = buf + len;
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		ltPush(lt, p - buf);
+		p++;
+	}
+}
+
+#ifdef SCRIB_X86
+//compare 16 bytes at a time against '\n' and walk the bits of the mask
+void lineScanSSE2(struct linetab *lt, const char *buf, size_t len) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		while (mask) {
+			ltPush(lt, i + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+	lineScanScalar(lt, buf, i, len);
+}
+
+//same as above, 32 bytes at a time on cpus that have avx2
+__attribute__((target("avx2")))
+void lineScanAVX2(struct linetab *lt, const char *buf, size_t len) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		while (mask) {
+			ltPush(lt, i + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+	lineScanScalar(lt, buf, i, len);
+}
+#endif
+
+//append the offset of every newline in buf[0..len) to the table,
+//len has to stay below 4GB so offsets fit in 32 bits
+void lineScan(struct linetab *lt, const char *buf, size_t len) {
+#ifdef SCRIB_X86
+	static int avx2 = -1;
+	if (avx2 == -1)
+		avx2 = __builtin_cpu_supports("avx2");
+	if (avx2)
+		lineScanAVX2(lt, buf, len);
+	else
+		lineScanSSE2(lt, buf, len);
+#else
+	lineScanScalar(lt, buf, 0, len);
+#endif
+}
+
+//one slice of the file handed to an indexing thread
+struct scanjob {
+	const char *buf;
+	size_t len;
+	struct linetab lt;
+};
+
+void *lineScanWorker(void *arg) {
+	struct scanjob *job = arg;
+	lineScan(&job->lt, job->buf, job->len);
+	return NULL;
+}
+
+//split buf[0..len) into slices that are scanned by worker threads in
+//parallel, returns the slices in file order with their newline tables
+struct scanjob *lineScanParallel(const char *buf, size_t len, int *njobs) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = ncpu > 0 ? (ncpu > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : ncpu) : 1;
+	size_t per = len / nthreads;
+	if (per < SCAN_MIN_CHUNK) per = SCAN_MIN_CHUNK;
+	if (per > SCAN_MAX_CHUNK) per = SCAN_MAX_CHUNK;
+	int n = (len + per - 1) / per;
+	int i, j;
+
+	struct scanjob *jobs = memCalloc(MEM_ROWS, n, sizeof(struct scanjob));
+	if (jobs == NULL) die("calloc");
+	for (i = 0; i < n; i++) {
+		jobs[i].buf = buf + (size_t)i * per;
+		jobs[i].len = (i == n - 1) ? len - (size_t)i * per : per;
+	}
+
+	//run the slices in waves of at most nthreads, the calling thread
+	//takes the first slice of each wave itself
+	pthread_t tid[SCAN_MAX_THREADS];
+	for (i = 0; i < n; i += nthreads) {
+		int wave = (n - i < nthreads) ? n - i : nthreads;
+		int started = 1;
+		for (j = 1; j < wave; j++, started++)
+			if (pthread_create(&tid[j], NULL, lineScanWorker, &jobs[i + j]) != 0)
+				break;
+		lineScanWorker(&jobs[i]);
+		for (j = 1; j < started; j++)
+			pthread_join(tid[j], NULL);
+		for (j = started; j < wave; j++)	//thread creation failed
+			lineScanWorker(&jobs[i + j]);
+	}
+	*njobs = n;
+	return jobs;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* row text *******************************/
+
+//size class of a row of 'size' bytes: multiples of 8 up to 64, then
+//four classes to every power of two, which wastes at most a fifth.
+//classes past TEXT_CLASSES are allocated with malloc
+int textClass(int size) {
+	if (size <= 64)
+		return size > 8 ? (size - 1) / 8 : 0;
+	int e = 31 - __builtin_clz(size - 1);
+	return 8 + (e - 6) * 4 + ((size - 1 - (1 << e)) >> (e - 2));
+}
+
+
+//bytes rows of class 'c' have room for, cut down to INT_MAX for the
+//classes that would go past it
+int textClassSize(int c) {
+	if (c < 8)
+		return (c + 1) * 8;
+	int e = (c - 8) / 4 + 6;
+	long long size = (1LL << e) + ((c - 8) % 4 + 1) * (1LL << (e - 2));
+	return size < INT_MAX ? size : INT_MAX;
+}
+
+
+//give a row chars of its own for at least 'size' bytes, in the size
+//class the size falls in. rows up to TEXT_MAX_CLASS come out of slabs of
+//their class, so they carry no allocator header and freed ones are
+//reused for the next row of the same class
+void textAlloc(erow *row, int size) {
+	struct textpool *tp = &E.text;
+	int c = textClass(size);
+	size = textClassSize(c);
+	row->cls = c;
+	if (size > TEXT_MAX_CLASS) {
+		row->chars = memAlloc(MEM_TEXT, size);
+		if (row->chars == NULL) die("malloc");
+		return;
+	}
+
+	char *p = tp->free[c];
+	if (p) {
+		memcpy(&tp->free[c], p, sizeof(char *));
+		row->chars = p;
+		return;
+	}
+	if (tp->end[c] - tp->next[c] < size) {
+		struct textblock *b = memAlloc(MEM_TEXT, TEXT_SLAB);
+		if (b == NULL) die("malloc");
+		b->next = tp->slabs;
+		tp->slabs = b;
+		tp->next[c] = b->data;
+		tp->end[c] = (char *)b + TEXT_SLAB;
+	}
+	row->chars = tp->next[c];
+	tp->next[c] += size;
+}
+
+
+//give back chars textAlloc handed out to a row
+void textFree(erow *row) {
+	struct textpool *tp = &E.text;
+	int c = row->cls;
+	if (textClassSize(c) > TEXT_MAX_CLASS) {
+		memFree(MEM_TEXT, row->chars);
+		return;
+	}
+	memcpy(row->chars, &tp->free[c], sizeof(char *));
+	tp->free[c] = row->chars;
+}
+
+
+//copy a line of a file that could not be mapped into the current
+//arena. rows holding such text are ROW_ARENA and are never freed one by
+//one, an edit gives them chars of their own as it does mapped rows
+char *textLoad(const char *s, size_t len) {
+	struct textpool *tp = &E.text;
+	if ((size_t)(tp->arenaend - tp->arenanext) < len + 1) {
+		size_t size = TEXT_ARENA;
+		if (size < sizeof(struct textblock) + len + 1)	//a line longer than an arena
+			size = sizeof(struct textblock) + len + 1;
+		struct textblock *b = memAlloc(MEM_TEXT, size);
+		if (b == NULL) die("malloc");
+		b->next = tp->arenas;
+		tp->arenas = b;
+		tp->arenanext = b->data;
+		tp->arenaend = (char *)b + size;
+	}
+	char *p = tp->arenanext;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	tp->arenanext += len + 1;
+	return p;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* row operations *****************/
+
+//row 'at' for a caller about to change it. keeps track of how much of
+//the file is still unchanged for editorSave, and copies the row out of
+//the way of a save in progress
+erow *editorRowEdit(int at) {
+	if (at < E.dirtyrow)
+		E.dirtyrow = at;
+	return rtRowMutable(at);
+}
+
+
+//the text of a row, wherever it is kept
+char *editorRowText(const erow *row) {
+	if (row->flags & ROW_INLINE)
+		return (char *)row + offsetof(erow, text);
+	return row->chars;
+}
+
+
+//bytes the chars of a row that owns them have room for
+int editorRowCap(const erow *row) {
+	return textClassSize(row->cls);
+}
+
+
+//character 'i' of a row, stepping over the gap if the row has one
+char editorRowChar(erow *row, int i) {
+	if ((row->flags & ROW_GAP) && i >= E.gap)
+		i += E.gaplen;
+	return editorRowText(row)[i];
+}
+
+
+//for rendering tabs, converting cx to rx
+int editorRowCxToRx(erow *row, int cx) {
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++) {
+	if (editorRowChar(row, j) == '\t')
+	  rx += (SCRIB_TAB_STOP - 1) - (rx % SCRIB_TAB_STOP);
+	rx++;
+  }
+  return rx;
+}
+
+
+//tell whether any of the first 'n' characters of a row is a tab
+int editorRowHasTab(erow *row, int n) {
+	if (!(row->flags & ROW_GAP) || n <= E.gap)
+		return memchr(editorRowText(row), '\t', n) != NULL;
+	return memchr(row->chars, '\t', E.gap) != NULL ||
+		   memchr(&row->chars[E.gap + E.gaplen], '\t', n - E.gap) != NULL;
+}
+
+
+//make sure a row can hold 'size' characters plus the terminating NUL,
+//growing the allocation geometrically so repeated edits stay cheap
+void editorRowReserve(erow *row, int size) {
+	int cap = editorRowCap(row);
+	if (size + 1 <= cap)
+		return;
+	erow old = *row;
+	int want = cap < INT_MAX / 2 ? cap * 2 : INT_MAX;
+	if (want < size + 1) want = size + 1;
+	if (want < 16) want = 16;
+	textAlloc(row, want);
+	memcpy(row->chars, old.chars, cap);	//the gap moves over later
+	textFree(&old);
+}
+
+
+//squeeze the gap out of the active row again, leaving its text contiguous
+void editorRowCloseGap() {
+	erow *row = E.gaprow;
+	if (row == NULL)
+		return;
+	memmove(&row->chars[E.gap], &row->chars[E.gap + E.gaplen],
+			row->size - E.gap + 1);
+	row->flags &= ~ROW_GAP;
+	E.gaprow = NULL;
+	E.gaplen = 0;
+}
+
+
+//put the gap of the active row at 'at', holding at least 'need' bytes.
+//typing keeps the gap at the cursor, so inserting or deleting there only
+//moves the gap edge instead of the rest of the line
+void editorRowOpenGap(erow *row, int at, int need) {
+	if (E.gaprow != row) {
+		editorRowCloseGap();
+		editorRowReserve(row, row->size + need);
+		//the spare capacity at the end of the line becomes the gap
+		row->flags |= ROW_GAP;
+		E.gaprow = row;
+		E.gap = row->size;
+		E.gaplen = editorRowCap(row) - row->size - 1;
+		row->chars[editorRowCap(row) - 1] = '\0';
+	}
+
+	if (at < E.gap)
+		memmove(&row->chars[at + E.gaplen], &row->chars[at], E.gap - at);
+	else if (at > E.gap)
+		memmove(&row->chars[E.gap], &row->chars[E.gap + E.gaplen], at - E.gap);
+	E.gap = at;
+
+	if (E.gaplen < need) {
+		int oldcap = editorRowCap(row);
+		int tail = row->size - at + 1;	//text after the gap and the NUL
+		editorRowReserve(row, row->size + need);
+		int cap = editorRowCap(row);
+		memmove(&row->chars[cap - tail], &row->chars[oldcap - tail], tail);
+		E.gaplen = cap - row->size - 1;
+	}
+}
+
+
+
+
+//add the line read from input file into a newly created row 
+void editorInsertRow(int at, char *s, size_t len) {
+
+  	if (at < 0 || at > E.numrows) return;
+	findStop();	//its matches are where they were before this
+
+	erow r;
+	r.size = len;
+	r.flags = 0;
+	r.cls = 0;
+	if ((int)len <= ROW_INLINE_MAX) {	//empty and short rows need no chars
+		r.flags = ROW_INLINE;
+		if (len > 0)
+			memcpy(editorRowText(&r), s, len);
+	} else {
+		textAlloc(&r, len + 1);
+		memcpy(r.chars, s, len);
+		r.chars[len] = '\0';
+	}
+
+	editorPlaceRow(at, &r);
+	if (at < E.dirtyrow)
+		E.dirtyrow = at;
+	E.dirty++;	//increment when changes are made
+	//'s' may be inline in a row placing this one just moved
+	journalRecord(JOURNAL_INSERT_ROW, at, 0, editorRowText(&r), len);
+	undoRecord(UNDO_ROWS_INSERT, at, 0, NULL, 1);
+}
+
+
+//link an already built row into the row tree at position 'at'
+void editorPlaceRow(int at, erow *r) {
+	//rows can move between leaves unless they are only appended
+	if (at < E.numrows)
+		editorRowCloseGap();
+	if (E.rows == NULL)
+		E.rows = rtNewNode(1);
+	struct rownode *split = rtInsert(rtUnshare(&E.rows), at, r);
+	if (split) {	//root was split, grow the tree by one level
+		struct rowinner *root = (struct rowinner *)rtNewNode(0);
+		root->child[0] = E.rows;
+		root->child[1] = split;
+		root->h.n = 2;
+		rtRecount(&root->h);
+		E.rows = &root->h;
+	}
+	E.numrows++;
+}
+
+
+//add the mapped line E.map[start..end) as a row that is only a slice of
+//the mapping, a private copy of chars is only made when it is edited
+void editorIndexLine(size_t start, size_t end) {
+	//strip the carriage returns of dos line endings, the row is then
+	//no longer saved as it is in the file
+	if (end > start && E.map[end - 1] == '\r' && E.numrows < E.dirtyrow)
+		E.dirtyrow = E.numrows;
+	while (end > start && E.map[end - 1] == '\r')
+		end--;
+
+	erow r;
+	r.size = end - start;
+	r.chars = E.map + start;
+	r.cls = 0;
+	r.flags = ROW_MAPPED;
+	editorPlaceRow(E.numrows, &r);
+}
+
+
+//index lines of the mapped file until row 'upto' exists or the mapping
+//is exhausted. asking for every row scans the rest of the file on all cpus
+void editorIndexRows(int upto) {
+	static struct linetab lt;
+	size_t j;
+
+	if (E.mapoff >= E.maplen || E.numrows > upto)
+		return;
+
+	if (upto == INT_MAX) {
+		int njobs, i;
+		struct scanjob *jobs = lineScanParallel(E.map + E.mapoff,
+												E.maplen - E.mapoff, &njobs);
+		//merge the per slice tables, lines may straddle slice boundaries
+		for (i = 0; i < njobs; i++) {
+			size_t base = jobs[i].buf - E.map;
+			for (j = 0; j < jobs[i].lt.n; j++) {
+				size_t nl = base + jobs[i].lt.off[j];
+				editorIndexLine(E.mapoff, nl);
+				E.mapoff = nl + 1;
+			}
+			memFree(MEM_ROWS, jobs[i].lt.off);
+		}
+		memFree(MEM_ROWS, jobs);
+		if (E.mapoff < E.maplen)
+			editorIndexLine(E.mapoff, E.maplen);
+		E.mapoff = E.maplen;
+		return;
+	}
+
+	size_t from = E.mapoff;
+	while (E.mapoff < E.maplen && E.numrows <= upto) {
+		if (from == E.maplen) {	//last line has no newline
+			editorIndexLine(E.mapoff, E.maplen);
+			E.mapoff = E.maplen;
+			break;
+		}
+		size_t len = E.maplen - from;
+		if (len > SCAN_BLOCK) len = SCAN_BLOCK;
+
+		lt.n = 0;
+		lineScan(&lt, E.map + from, len);
+		for (j = 0; j < lt.n; j++) {
+			size_t nl = from + lt.off[j];
+			editorIndexLine(E.mapoff, nl);
+			E.mapoff = nl + 1;
+		}
+		from += len;
+	}
+}
+
+
+//free the chars of a heap row, unless a save in progress may still be
+//writing them out, then that is left until it is done. arena text
+//stays until the arena goes
+void editorDropChars(erow *row) {
+	struct savejob *job = E.save;
+	if (row->flags & (ROW_ARENA | ROW_INLINE))
+		return;
+	if ((row->flags & ROW_SHARED) && job) {
+		if (job->nfreed == job->freedcap) {
+			job->freedcap = job->freedcap ? job->freedcap * 2 : 64;
+			job->freed = memRealloc(MEM_SAVE, job->freed, job->freedcap * sizeof(erow));
+			if (job->freed == NULL) die("realloc");
+		}
+		job->freed[job->nfreed++] = *row;
+		return;
+	}
+	textFree(row);
+}
+
+
+//give a row its own copy of the text, it may still point into the
+//mapped file or an arena, be inline, or share it with a save in progress
+void editorRowMaterialize(erow *row) {
+	if (!(row->flags & (ROW_MAPPED | ROW_SHARED | ROW_ARENA | ROW_INLINE)))
+		return;
+	erow old = *row;
+	textAlloc(row, row->size + 1);
+	memcpy(row->chars, editorRowText(&old), row->size);
+	row->chars[row->size] = '\0';
+	if (old.flags & ROW_SHARED)
+		editorDropChars(&old);
+	row->flags &= ~(ROW_MAPPED | ROW_SHARED | ROW_ARENA | ROW_INLINE);
+}
+
+
+void editorFreeRow(erow *row) {
+  	if (!(row->flags & ROW_MAPPED))
+  		editorDropChars(row);
+}
+
+//deleting a row when del key is pressed at the beginning of a row
+void editorDelRow(int at) {
+  	
+  	//if cursor is at eof, no need to delete any row
+  	if (at < 0 || at >= E.numrows) 
+  		return;
+  	findStop();
+  	editorRowCloseGap();
+  	erow *row = editorRowAt(at);
+  	undoRecord(UNDO_ROWS_DELETE, at, 0, editorRowText(row), row->size);
+  	editorFreeRow(rtRowMutable(at));
+  	rtDelete(E.rows, at);
+
+  	//drop interior roots left with a single child
+  	while (!E.rows->leaf && E.rows->n == 1) {
+  		struct rownode *child = ((struct rowinner *)E.rows)->child[0];
+  		memFree(MEM_ROWS, E.rows);
+  		E.rows = child;
+  	}
+  	E.numrows--;
+  	if (at < E.dirtyrow)
+  		E.dirtyrow = at;
+  	E.dirty++;
+  	journalRecord(JOURNAL_DEL_ROW, at, 0, NULL, 0);
+}
+
+
+//insert 'len' bytes of 's' into row 'y' at 'at', through the gap
+void editorRowInsertString(int y, int at, char *s, size_t len) {
+	findStop();
+	erow *row = editorRowEdit(y);
+	if (at < 0 || at > row->size) 
+			at = row->size;
+	editorRowMaterialize(row);
+	editorRowOpenGap(row, at, len);
+	memcpy(&row->chars[E.gap], s, len);
+	E.gap += len;
+	E.gaplen -= len;
+	row->size += len;
+	E.dirty++;
+	journalRecord(JOURNAL_INSERT, y, at, s, len);
+	undoRecord(UNDO_INSERT, y, at, NULL, len);
+}
+
+
+//insert a character into a particular position in row 'y'
+void editorRowInsertChar(int y, int at, int c) {
+	char ch = c;
+	editorRowInsertString(y, at, &ch, 1);
 }
 
 
 //append row to end of previous row when del key is pressed at beginning of a row
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  	row->chars = realloc(row->chars, row->size + len + 1);
-  	memcpy(&row->chars[row->size], s, len);
-  	row->size += len;
-  	row->chars[row->size] = '\0';
-  	editorUpdateRow(row);
+void editorRowAppendString(int y, char *s, size_t len) {
+  	editorRowInsertString(y, editorRowAt(y)->size, s, len);
+}
+
+
+//delete 'len' characters of row 'y' from 'at' on, they end up in the gap
+void editorRowDelString(int y, int at, int len) {
+  	findStop();
+  	erow *row = editorRowEdit(y);
+  	if (at < 0 || len <= 0 || at >= row->size || len > row->size - at) return;
+  	editorRowMaterialize(row);
+  	editorRowOpenGap(row, at + len, 0);
+  	undoRecord(UNDO_DELETE, y, at, &row->chars[at], len);
+  	E.gap = at;
+  	E.gaplen += len;
+  	row->size -= len;
   	E.dirty++;
+  	journalRecord(JOURNAL_DELETE, y, at, NULL, len);
+}
+
+
+//cut row 'y' short so it ends at 'at'
+void editorRowTruncate(int y, int at) {
+	editorRowDelString(y, at, editorRowAt(y)->size - at);
 }
 
 //delete a character 
-void editorRowDelChar(erow *row, int at) {
-  	if (at < 0 || at >= row->size) return;
-  	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  	row->size--;
-  	editorUpdateRow(row);
-  	E.dirty++;
+void editorRowDelChar(int y, int at) {
+  	editorRowDelString(y, at, 1);
 }
 
 
@@ -405,7 +2053,7 @@ void editorInsertChar(int c) {
 	if (E.cy == E.numrows) {
 		editorInsertRow(E.numrows, "", 0);
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
+	editorRowInsertChar(E.cy, E.cx, c);
 	E.cx++;
 }
 
@@ -417,17 +2065,60 @@ void editorInsertNewline() {
   	if (E.cx == 0) {
   	  	editorInsertRow(E.cy, "", 0);
   	} else {	//if cursor is in middle of row, divide the row and add to next line
-  	  	erow *row = &E.row[E.cy];
-  	  	editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-  	  	row = &E.row[E.cy];
-  	  	row->size = E.cx;
-  	  	row->chars[row->size] = '\0';
-  	  	editorUpdateRow(row);
+  	  	erow *row = editorRowAt(E.cy);
+  	  	editorRowCloseGap();
+  	  	editorInsertRow(E.cy + 1, &editorRowText(row)[E.cx], row->size - E.cx);
+  	  	editorRowTruncate(E.cy, E.cx);
   	}
   	E.cy++;
   	E.cx = 0;
 }
 
+//insert a block of text at the cursor in one go, as for a paste. line
+//breaks in it ('\n', '\r' or both) split the row, and the cursor ends
+//up just after the inserted text
+void editorInsertText(char *s, size_t len) {
+	if (E.cy == E.numrows)
+		editorInsertRow(E.numrows, "", 0);
+
+	//cut the rest of the row off, it goes back on after the last line
+	erow *row = editorRowAt(E.cy);
+	editorRowCloseGap();
+	int taillen = row->size - E.cx;
+	char *tail = malloc(taillen + 1);
+	if (tail == NULL) die("malloc");
+	memcpy(tail, &editorRowText(row)[E.cx], taillen);
+	editorRowTruncate(E.cy, E.cx);
+
+	size_t i = 0;
+	while (1) {
+		size_t j = i;
+		while (j < len && s[j] != '\n' && s[j] != '\r')
+			j++;
+		if (i == 0) {
+			editorRowAppendString(E.cy, s, j);
+			E.cx += j;
+		} else {
+			editorInsertRow(++E.cy, &s[i], j - i);
+			E.cx = j - i;
+		}
+		if (j == len)
+			break;
+		if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n')
+			j++;
+		i = j + 1;
+		if (i == len) {	//text ends with a line break
+			editorInsertRow(++E.cy, "", 0);
+			E.cx = 0;
+			break;
+		}
+	}
+
+	editorRowAppendString(E.cy, tail, taillen);
+	free(tail);
+}
+
+
 //deletes te char left of cursor
 void editorDelChar() {
   	
@@ -439,13 +2130,14 @@ void editorDelChar() {
   	//no need to append row to previous
   	if (E.cx == 0 && E.cy == 0) 
   		return;
-  	erow *row = &E.row[E.cy];
   	if (E.cx > 0) {
-  	  	editorRowDelChar(row, E.cx - 1);
+  	  	editorRowDelChar(E.cy, E.cx - 1);
   	  	E.cx--;
   	} else { //if cursor at beginning of row and del key is pressed
-    	E.cx = E.row[E.cy - 1].size;
-    	editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    	editorRowCloseGap();
+    	erow *row = editorRowAt(E.cy);
+    	E.cx = editorRowAt(E.cy - 1)->size;
+    	editorRowAppendString(E.cy - 1, editorRowText(row), row->size);
     	editorDelRow(E.cy);
     	E.cy--;
   	}
@@ -463,115 +2155,2947 @@ void editorDelChar() {
 
 
 
-/*********************** file i/o *************************/
+/******************************* journal *******************************/
 
-//convert all the rows of editor into a single string to be written in a file
-char *editorRowsToString(int *buflen) {
-  	int totlen = 0;
-  	int j;
-  	for (j = 0; j < E.numrows; j++)
-  	  	totlen += E.row[j].size + 1;
-  	*buflen = totlen;
-  	char *buf = malloc(totlen);
-  	char *p = buf;
-  	for (j = 0; j < E.numrows; j++) {
-  	  	memcpy(p, E.row[j].chars, E.row[j].size);
-  	  	p += E.row[j].size;
-  	  	*p = '\n';
-  	  	p++;
-  	}
-  	return buf;
-}	
+//every change the row primitives make is also appended to a journal
+//beside the file, a few bytes an edit. after a crash editorOpen replays
+//it on top of the file. that only works while the file is still the one
+//the header describes, so each save starts the journal over
+struct journalHeader {
+	char magic[8];
+	uint64_t size;          //size and mtime of the file the records apply to
+	int64_t mtime;
+	int64_t mtimens;
+};
 
 
-//open file in editor
-void editorOpen(char *filename) {
+//name of the journal of 'filename', a hidden .swp file next to it
+char *journalPath(char *filename) {
+	char *slash = strrchr(filename, '/');
+	int dirlen = slash ? slash - filename + 1 : 0;
+	char *path = malloc(strlen(filename) + 6);
+	if (path == NULL) die("malloc");
+	sprintf(path, "%.*s.%s.swp", dirlen, filename, filename + dirlen);
+	return path;
+}
 
-	free(E.filename);
-	E.filename = strdup(filename);
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("fopen");
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	
-	//keep reading until length of row read is 0, i.e. empty row reached end of file
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
+//stop journaling after an error, until the next save starts it over
+void journalFail() {
+	editorSetStatusMessage("Journal off, can't write it: %s", strerror(errno));
+	if (E.jfd != -1)
+		close(E.jfd);
+	E.jfd = -1;
+	E.jlen = 0;
+	E.jdirty = 0;
+}
 
-		//calculate length of row read
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-							   line[linelen - 1] == '\r'))
-			linelen--;
-		//add the new row to our existing array of rows
-		editorInsertRow(E.numrows, line, linelen);
 
-	}
-	free(line);
-	fclose(fp);
+//append 'v' to the buffered records, 7 bits to a byte
+void journalNum(size_t v) {
+	while (v >= 0x80) {
+		E.jbuf[E.jlen++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	E.jbuf[E.jlen++] = v;
+}
+
+
+//read back a number written by journalNum, 0 if it is cut off
+int journalGetNum(const char *p, size_t len, size_t *off, size_t *v) {
+	int shift = 0;
+	*v = 0;
+	while (*off < len && shift < 64) {
+		unsigned char b = p[(*off)++];
+		*v |= (size_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+
+//write out the buffered records. they are sure to be on disk once
+//journalSync has run, at most JOURNAL_SYNC seconds later
+void journalFlush() {
+	size_t off = 0;
+
+	if (E.jfd == -1 || E.jlen == 0)
+		return;
+	while (off < E.jlen) {
+		ssize_t w = write(E.jfd, E.jbuf + off, E.jlen - off);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			journalFail();
+			return;
+		}
+		off += w;
+	}
+	E.jsize += E.jlen;
+	E.jlen = 0;
+	if (E.jdirty == 0)
+		E.jdirty = time(NULL);
+}
+
+
+void journalSync() {
+	journalFlush();
+	if (E.jfd != -1 && E.jdirty && fdatasync(E.jfd) == -1)
+		journalFail();
+	E.jdirty = 0;
+}
+
+
+//note a change made by a row primitive: what it was, the row, a column,
+//a length and the text it inserted if any. buffered until journalFlush
+void journalRecord(int op, int y, int at, const char *s, size_t len) {
+	if (E.jfd == -1)
+		return;
+	size_t need = E.jlen + len + 32;	//op, three numbers and the text
+	if (need > E.jcap) {
+		E.jcap = need > E.jcap * 2 ? need : E.jcap * 2;
+		E.jbuf = memRealloc(MEM_JOURNAL, E.jbuf, E.jcap);
+		if (E.jbuf == NULL) die("realloc");
+	}
+	E.jbuf[E.jlen++] = op;
+	journalNum(y);
+	journalNum(at);
+	journalNum(len);
+	if (s && len) {
+		memcpy(&E.jbuf[E.jlen], s, len);
+		E.jlen += len;
+	}
+	if (E.jlen >= JOURNAL_BUF)
+		journalFlush();
+}
+
+
+//is the journal held by another session editing the same file
+int journalBusy() {
+	int fd = open(E.jpath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	int busy = flock(fd, LOCK_SH | LOCK_NB) == -1;
+	close(fd);
+	return busy;
+}
+
+
+//start the journal over for the file as it is on disk now, 'st'. the
+//records from offset 'keep' of the old journal on are carried over, the
+//file doesn't have those changes yet. the new journal is renamed into
+//place, a crash leaves either the old one or the new one
+void journalReset(struct stat *st, off_t keep) {
+	struct journalHeader h;
+	char buf[JOURNAL_BUF];
+
+	if (E.jpath == NULL || (E.jfd == -1 && journalBusy()))
+		return;
+	journalFlush();
+	char *tmp = malloc(strlen(E.jpath) + 8);
+	if (tmp == NULL) die("malloc");
+	sprintf(tmp, "%s.XXXXXX", E.jpath);
+	int fd = mkstemp(tmp);
+	if (fd == -1) {
+		free(tmp);
+		journalFail();
+		return;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+	h.size = st->st_size;
+	h.mtime = st->st_mtim.tv_sec;
+	h.mtimens = st->st_mtim.tv_nsec;
+	off_t size = sizeof(h);
+	int ok = write(fd, &h, sizeof(h)) == sizeof(h);
+	while (ok && E.jfd != -1 && keep < E.jsize) {
+		off_t left = E.jsize - keep;
+		ssize_t n = pread(E.jfd, buf, left < (off_t)sizeof(buf) ? (size_t)left : sizeof(buf), keep);
+		ok = n > 0 && write(fd, buf, n) == n;
+		keep += n;
+		size += n;
+	}
+
+	if (ok && flock(fd, LOCK_EX | LOCK_NB) != -1 && fdatasync(fd) != -1 &&
+		rename(tmp, E.jpath) != -1) {
+		if (E.jfd != -1)
+			close(E.jfd);
+		E.jfd = fd;
+		E.jsize = size;
+		E.jdirty = 0;
+	} else {
+		int err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		journalFail();
+	}
+	free(tmp);
+}
+
+
+//apply the records at 'p' up to the first cut off or damaged one, the
+//tail of a write a crash interrupted. returns the bytes of good records
+//and how many there were in *n
+size_t journalReplay(char *p, size_t len, int *n) {
+	size_t off = 0;
+
+	*n = 0;
+	while (off < len) {
+		size_t rec = off, y, at, slen;
+		int op = (unsigned char)p[off++];
+		if (!journalGetNum(p, len, &off, &y) || !journalGetNum(p, len, &off, &at) ||
+			!journalGetNum(p, len, &off, &slen) || y >= INT_MAX || slen >= INT_MAX)
+			return rec;
+		char *s = &p[off];
+		if (op == JOURNAL_INSERT_ROW || op == JOURNAL_INSERT) {
+			if (slen > len - off)
+				return rec;
+			off += slen;
+		}
+
+		editorIndexRows(y);
+		erow *row = (int)y < E.numrows ? editorRowAt(y) : NULL;
+		switch (op) {
+			case JOURNAL_INSERT_ROW:
+				if ((int)y > E.numrows)
+					return rec;
+				editorInsertRow(y, s, slen);
+				break;
+			case JOURNAL_DEL_ROW:
+				if (row == NULL)
+					return rec;
+				editorDelRow(y);
+				break;
+			case JOURNAL_INSERT:
+				if (row == NULL || at > (size_t)row->size ||
+					slen > (size_t)(INT_MAX - row->size))
+					return rec;
+				editorRowInsertString(y, at, s, slen);
+				break;
+			case JOURNAL_DELETE:
+				if (row == NULL || at >= (size_t)row->size || slen > row->size - at)
+					return rec;
+				editorRowDelString(y, at, slen);
+				break;
+			default:
+				return rec;
+		}
+		(*n)++;
+		//leave the cursor where the last change was made
+		E.cy = y < (size_t)E.numrows ? (int)y : E.numrows;
+		E.cx = 0;
+	}
+	return off;
+}
+
+
+//pick up the journal of the file just opened, 'st'. changes a crashed
+//session left in it are replayed, otherwise a new one is started
+void journalOpen(char *filename, struct stat *st) {
+	struct journalHeader h;
+	struct stat js;
+
+	free(E.jpath);
+	E.jpath = journalPath(filename);
+	int fd = open(E.jpath, O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		journalReset(st, 0);
+		return;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		editorSetStatusMessage("%s is in use, this session has no journal", E.jpath);
+		return;
+	}
+	if (fstat(fd, &js) == -1 || js.st_size < (off_t)sizeof(h) ||
+		read(fd, &h, sizeof(h)) != sizeof(h) ||
+		memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+		h.size != (uint64_t)st->st_size || h.mtime != st->st_mtim.tv_sec ||
+		h.mtimens != st->st_mtim.tv_nsec) {
+		//the file was changed since, the records no longer fit it
+		close(fd);
+		editorSetStatusMessage("%s doesn't match the file, not recovered", E.jpath);
+		journalReset(st, 0);
+		return;
+	}
+
+	int n = 0;
+	size_t used = 0;
+	if (js.st_size > (off_t)sizeof(h)) {
+		char *p = mmap(NULL, js.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			used = journalReplay(p + sizeof(h), js.st_size - sizeof(h), &n);
+			munmap(p, js.st_size);
+		}
+	}
+	//new records go after the last good one
+	E.jsize = sizeof(h) + used;
+	if (ftruncate(fd, E.jsize) == -1 || lseek(fd, E.jsize, SEEK_SET) == -1) {
+		close(fd);
+		journalFail();
+		return;
+	}
+	E.jfd = fd;
+	if (n)
+		editorSetStatusMessage("Recovered %d changes from %s, Ctrl-S to keep them",
+							   n, E.jpath);
+}
+
+
+//the session ends cleanly, there is nothing to recover
+void journalDiscard() {
+	if (E.jpath)
+		unlink(E.jpath);
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* undo *******************************/
+
+//the row primitives log every change as a delta. an insert only keeps
+//where it went and how long it was, a delete keeps the text it took out.
+//a run of typed characters or backspaces becomes one delta, as do whole
+//rows inserted or deleted one after another, so undoing a paste of a
+//million lines deletes them in one go instead of replaying each one
+
+
+//forget the deltas [from, to) of a history
+void undoDrop(struct undoStack *st, int from, int to) {
+	int j;
+	for (j = from; j < to; j++) {
+		E.umem -= sizeof(struct undoOp) + st->op[j].tcap;
+		memFree(MEM_UNDO, st->op[j].text);
+	}
+	memmove(&st->op[from], &st->op[to], (st->n - to) * sizeof(struct undoOp));
+	st->n -= to - from;
+}
+
+
+//where the last step of a history starts
+int undoLastStep(struct undoStack *st) {
+	int i = st->n - 1;
+	while (i > 0 && !st->op[i].step)
+		i--;
+	return i;
+}
+
+
+//keep the history within E.umax, the oldest steps go first, then those
+//furthest off to redo. if the step being recorded in 'cur' is too big
+//on its own, it is dropped and the rest of it isn't recorded
+void undoTrim(struct undoStack *cur) {
+	struct undoStack *order[2] = { &E.undo, &E.redo };
+	int k;
+
+	if (E.umem <= E.umax)
+		return;
+	for (k = 0; k < 2; k++) {
+		struct undoStack *st = order[k];
+		int keep = st == cur ? undoLastStep(st) : st->n;
+		size_t mem = E.umem;
+		int i = 0;
+		//well below the cap, so trimming doesn't happen every key
+		while (i < keep && mem > E.umax / 4 * 3) {
+			do {
+				mem -= sizeof(struct undoOp) + st->op[i].tcap;
+				i++;
+			} while (i < keep && !st->op[i].step);
+		}
+		undoDrop(st, 0, i);
+	}
+	if (E.umem > E.umax) {
+		undoDrop(cur, undoLastStep(cur), cur->n);
+		E.uskip = 1;
+		editorSetStatusMessage("Change too big to undo, history is limited to %zu MB",
+							   E.umax >> 20);
+	}
+}
+
+
+//add 'len' bytes of 's' to the text of a delta, before what it has if
+//'front' is set
+void undoText(struct undoOp *u, const char *s, size_t len, int front) {
+	if (len == 0)	//an empty row being deleted, text may still be NULL
+		return;
+	if (u->tlen + len > u->tcap) {
+		size_t cap = u->tcap * 2 > u->tlen + len ? u->tcap * 2 : u->tlen + len;
+		u->text = memRealloc(MEM_UNDO, u->text, cap);
+		if (u->text == NULL) die("realloc");
+		E.umem += cap - u->tcap;
+		u->tcap = cap;
+	}
+	if (front) {
+		memmove(&u->text[len], u->text, u->tlen);
+		memcpy(u->text, s, len);
+	} else {
+		memcpy(&u->text[u->tlen], s, len);
+	}
+	u->tlen += len;
+}
+
+
+//add a deleted row to the text of a delta, after its length. a row can
+//hold a newline, so newlines can't separate them
+void undoRowText(struct undoOp *u, const char *s, size_t len) {
+	undoText(u, (const char *)&len, sizeof(len), 0);
+	undoText(u, s, len, 0);
+}
+
+
+//can a delta just be added to the last one instead
+int undoMerge(struct undoOp *last, int op, int y, int at, const char *s, size_t len) {
+	if (last->op != op || last->y != (op == UNDO_ROWS_INSERT ? y - (int)last->len : y))
+		return 0;
+	//only typing runs on from one key to the next
+	if (E.ubreak == UNDO_BREAK || (E.ubreak == UNDO_JOIN &&
+		(!last->step || op == UNDO_ROWS_INSERT || op == UNDO_ROWS_DELETE)))
+		return 0;
+
+	switch (op) {
+		case UNDO_INSERT:
+			if (at != last->at + (int)last->len)
+				return 0;
+			last->len += len;
+			return 1;
+		case UNDO_DELETE:
+			if (at + (int)len == last->at) {	//backspacing
+				undoText(last, s, len, 1);
+				last->at = at;
+			} else if (at == last->at) {		//deleting forward
+				undoText(last, s, len, 0);
+			} else {
+				return 0;
+			}
+			last->len += len;
+			return 1;
+		case UNDO_ROWS_INSERT:
+			last->len++;
+			return 1;
+		case UNDO_ROWS_DELETE:
+			undoRowText(last, s, len);
+			last->len++;
+			return 1;
+	}
+	return 0;
+}
+
+
+//log a change made by a row primitive. 's' is the text a delete took
+//out. a new edit makes what was undone unreachable
+void undoRecord(int op, int y, int at, const char *s, size_t len) {
+	struct undoStack *st = E.urec == UNDO_UNDOING ? &E.redo : &E.undo;
+
+	if (E.uskip || (len == 0 && op != UNDO_ROWS_DELETE))
+		return;
+	if (E.urec == 0 && E.redo.n)
+		undoDrop(&E.redo, 0, E.redo.n);
+
+	if (st->n && undoMerge(&st->op[st->n - 1], op, y, at, s, len)) {
+		E.ubreak = 0;
+		undoTrim(st);
+		return;
+	}
+
+	if (st->n == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 64;
+		st->op = memRealloc(MEM_UNDO, st->op, st->cap * sizeof(struct undoOp));
+		if (st->op == NULL) die("realloc");
+	}
+	struct undoOp *u = &st->op[st->n++];
+	u->op = op;
+	u->y = y;
+	u->at = at;
+	u->len = op == UNDO_ROWS_DELETE ? 1 : len;
+	u->text = NULL;
+	u->tlen = u->tcap = 0;
+	u->step = E.ubreak || st->n == 1;
+	E.umem += sizeof(struct undoOp);
+	if (op == UNDO_DELETE)
+		undoText(u, s, len, 0);
+	else if (op == UNDO_ROWS_DELETE)
+		undoRowText(u, s, len);
+	E.ubreak = 0;
+	undoTrim(st);
+}
+
+
+//a key is about to be handled, its changes make up a new undo step.
+//typing and deleting characters may run on in the step before instead
+void undoStep(int key) {
+	if (key == RESIZE_KEY || key == TIMER_KEY || key == SAVED_KEY || key == FOUND_KEY)
+		return;
+	int typed = key == BACKSPACE || key == CTRL_KEY('h') || key == DEL_KEY ||
+				(key < 128 && !iscntrl(key));
+	E.ubreak = typed && E.utyped ? UNDO_JOIN : UNDO_BREAK;
+	E.utyped = typed;
+	E.uskip = 0;
+}
+
+
+//apply the opposite of a delta, the primitives log that in turn
+void undoApply(struct undoOp *u) {
+	size_t k;
+
+	editorIndexRows(u->y + 1);
+	switch (u->op) {
+		case UNDO_INSERT:
+			editorRowDelString(u->y, u->at, u->len);
+			break;
+		case UNDO_DELETE:
+			editorRowInsertString(u->y, u->at, u->text, u->tlen);
+			break;
+		case UNDO_ROWS_INSERT:
+			for (k = 0; k < u->len; k++)
+				editorDelRow(u->y);
+			break;
+		case UNDO_ROWS_DELETE: {
+			char *p = u->text;
+			for (k = 0; k < u->len; k++) {
+				size_t len;
+				memcpy(&len, p, sizeof(len));
+				p += sizeof(len);
+				editorInsertRow(u->y + k, p, len);
+				p += len;
+			}
+			break;
+		}
+	}
+}
+
+
+//take back the last step, or with 'redo' set what was last taken back
+void editorUndo(int redo) {
+	struct undoStack *st = redo ? &E.redo : &E.undo;
+	int j;
+
+	if (st->n == 0) {
+		editorSetStatusMessage(redo ? "Nothing to redo" : "Nothing to undo");
+		return;
+	}
+	//take the step off first, the other history may trim this one
+	int from = undoLastStep(st);
+	int n = st->n - from;
+	struct undoOp *ops = memAlloc(MEM_UNDO, n * sizeof(struct undoOp));
+	if (ops == NULL) die("malloc");
+	memcpy(ops, &st->op[from], n * sizeof(struct undoOp));
+	st->n = from;
+	for (j = 0; j < n; j++)
+		E.umem -= sizeof(struct undoOp) + ops[j].tcap;
+
+	E.urec = redo ? UNDO_REDOING : UNDO_UNDOING;
+	E.ubreak = UNDO_BREAK;
+	E.uskip = 0;
+	for (j = n - 1; j >= 0; j--) {
+		undoApply(&ops[j]);
+		//leave the cursor at the change
+		E.cy = ops[j].y < E.numrows ? ops[j].y : E.numrows;
+		E.cx = E.cy < E.numrows && ops[j].at <= editorRowAt(E.cy)->size ? ops[j].at : 0;
+		memFree(MEM_UNDO, ops[j].text);
+	}
+	memFree(MEM_UNDO, ops);
+	E.urec = 0;
+	E.ubreak = UNDO_BREAK;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/*********************** file i/o *************************/
+
+//write all of 'n' iovecs, writev may stop short of the end
+int editorWritev(int fd, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+
+//iovecs collected for one writev, rows are saved a batch at a time
+struct iobatch {
+	int fd;
+	int n;
+	int err;                //a writev failed, the rest is not sent
+	size_t len;             //bytes handed to ioPush so far
+	size_t *done;           //bytes written, kept up to date for the status bar
+	struct iovec iov[SAVE_IOV];
+};
+
+
+//write out what the batch holds
+int ioFlush(struct iobatch *b) {
+	size_t len = 0;
+	int j;
+	for (j = 0; j < b->n; j++)
+		len += b->iov[j].iov_len;
+	if (!b->err && editorWritev(b->fd, b->iov, b->n) == -1)
+		b->err = 1;
+	b->n = 0;
+	if (!b->err)
+		__atomic_add_fetch(b->done, len, __ATOMIC_RELAXED);
+	return b->err ? -1 : 0;
+}
+
+
+//queue 'len' bytes at 's' for writing, merged into the last iovec when
+//they follow on from it in memory
+void ioPush(struct iobatch *b, char *s, size_t len) {
+	b->len += len;
+	if (b->n > 0) {
+		struct iovec *last = &b->iov[b->n - 1];
+		if ((char *)last->iov_base + last->iov_len == s) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	if (b->n == SAVE_IOV)
+		ioFlush(b);
+	b->iov[b->n].iov_base = s;
+	b->iov[b->n++].iov_len = len;
+}
+
+
+//stream the rows of a save snapshot from job->from on straight from where
+//they live. rows still in the mapped file are sent along with the newline
+//after them, and the part of the file that was not indexed yet goes out
+//as it is, less the carriage returns indexing would have stripped
+int editorWriteRows(struct iobatch *b, struct savejob *job) {
+	static char newline[] = "\n";
+	int at, j, span, idx;
+
+	for (at = job->from; at < job->numrows; at += span) {
+		struct rowleaf *lf = rtFind(job->root, at, &idx);
+		erow *rows = &lf->row[idx];
+		span = lf->h.n - idx;
+		for (j = 0; j < span; j++) {
+			erow *row = &rows[j];
+			if ((row->flags & ROW_MAPPED) && row->chars + row->size < E.map + E.maplen &&
+				row->chars[row->size] == '\n') {
+				ioPush(b, row->chars, row->size + 1);
+			} else {
+				//inline text is in the snapshot's leaf, which stays until the save is done
+				ioPush(b, editorRowText(row), row->size);
+				ioPush(b, newline, 1);
+			}
+		}
+	}
+
+	if (job->tailoff == E.maplen)
+		return ioFlush(b);
+	char *p = E.map + job->tailoff;
+	char *end = E.map + E.maplen;
+	while (p < end) {
+		char *cr = memchr(p, '\r', end - p);
+		if (cr == NULL) {
+			ioPush(b, p, end - p);
+			break;
+		}
+		char *q = cr;
+		while (q < end && *q == '\r')
+			q++;
+		ioPush(b, p, (q == end || *q == '\n' ? cr : q) - p);
+		p = q;
+	}
+	if (end[-1] != '\n')
+		ioPush(b, newline, 1);
+	return ioFlush(b);
+}
+
+
+//how much of the buffer is still exactly as in the mapped file. returns
+//the first row that has to be written out, the ones before it take up
+//the first *bytes of the file
+int editorCleanRows(size_t *bytes) {
+	int k = E.dirtyrow < E.numrows ? E.dirtyrow : E.numrows;
+
+	*bytes = 0;
+	if (E.map == NULL || k == 0)
+		return 0;
+	erow *row = editorRowAt(k - 1);
+	size_t end = row->chars - E.map + row->size;
+	if (end < E.maplen && E.map[end] == '\n') {
+		*bytes = end + 1;
+		return k;
+	}
+	//the last line has no newline, it gets one when written out
+	*bytes = row->chars - E.map;
+	return k - 1;
+}
+
+
+//copy the first 'len' bytes of the mapped file to 'fd', letting the
+//kernel copy or share the blocks where the filesystem can
+int editorCopyPrefix(int fd, size_t len, size_t *done) {
+	loff_t in = 0;
+
+	while ((size_t)in < len) {
+		ssize_t n = copy_file_range(E.mapfd, &in, fd, NULL, len - in, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		__atomic_store_n(done, in, __ATOMIC_RELAXED);
+	}
+	//not every filesystem can, write whatever is left from the map
+	size_t off = in;
+	while (off < len) {
+		ssize_t w = write(fd, E.map + off, len - off);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		off += w;
+		__atomic_store_n(done, off, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+
+//write a save snapshot to 'fd', copying the unchanged start of the
+//mapped file first unless it is already there
+int editorSaveRows(struct savejob *job, int fd, int copy) {
+	struct iobatch *b = malloc(sizeof(struct iobatch));
+	size_t total = job->prefix + E.maplen - job->tailoff;
+	int at, j, span, idx;
+
+	if (b == NULL)
+		return -1;
+	//the size to expect, for the progress shown meanwhile
+	for (at = job->from; at < job->numrows; at += span) {
+		struct rowleaf *lf = rtFind(job->root, at, &idx);
+		span = lf->h.n - idx;
+		for (j = 0; j < span; j++)
+			total += lf->row[idx + j].size + 1;
+	}
+	__atomic_store_n(&job->total, total, __ATOMIC_RELAXED);
+
+	if (copy && editorCopyPrefix(fd, job->prefix, &job->done) == -1) {
+		free(b);
+		return -1;
+	}
+	__atomic_store_n(&job->done, job->prefix, __ATOMIC_RELAXED);
+	b->fd = fd;
+	b->n = 0;
+	b->err = 0;
+	b->len = 0;
+	b->done = &job->done;
+	int ret = editorWriteRows(b, job);
+	__atomic_store_n(&job->total, job->prefix + b->len, __ATOMIC_RELAXED);
+	free(b);
+	return ret;
+}
+
+
+//save into the mapped file itself, only rewriting it from the first
+//changed line on. not crash safe, so only done with SCRIB_INPLACE set
+int editorSaveInPlace(struct savejob *job) {
+	int fd = job->fd;
+	if (lseek(fd, job->prefix, SEEK_SET) != -1 && editorSaveRows(job, fd, 0) != -1 &&
+		ftruncate(fd, job->total) != -1 && (!E.syncsave || fsync(fd) != -1))
+		return close(fd);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+
+//save through a temporary file next to the target that is then renamed
+//over it, so a failed save never leaves a cut off file. the old file
+//stays intact underneath, rows mapped from it remain valid
+int editorSaveCopy(struct savejob *job) {
+	char *path = job->path;
+	int err;
+
+	char *tmp = malloc(strlen(path) + 8);
+	if (tmp == NULL)
+		return -1;
+	sprintf(tmp, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd != -1) {
+		//keeping another user's ownership only works for root. the save
+		//goes on without it, the status message says so
+		if (job->exists && fchown(fd, job->st.st_uid, job->st.st_gid) == -1)
+			job->ownererr = errno;
+		mode_t mode = job->exists ? job->st.st_mode & 07777 : job->mode;
+		if (fchmod(fd, mode) != -1 && editorSaveRows(job, fd, 1) != -1 &&
+			(!E.syncsave || fsync(fd) != -1)) {
+			if (close(fd) != -1 && rename(tmp, path) != -1) {
+				if (E.syncsave) {	//make the rename itself durable
+					char *slash = strrchr(path, '/');
+					if (slash)
+						*slash = '\0';
+					int dir = open(slash ? (slash == path ? "/" : path) : ".", O_RDONLY);
+					if (slash)
+						*slash = '/';
+					if (dir != -1) {
+						fsync(dir);
+						close(dir);
+					}
+				}
+				free(tmp);
+				return 0;
+			}
+		} else {
+			err = errno;
+			close(fd);
+			errno = err;
+		}
+		err = errno;
+		unlink(tmp);
+		errno = err;
+	}
+	err = errno;
+	free(tmp);
+	errno = err;
+	return -1;
+}
+
+
+//thread writing out a save job, it signals E.savefd when done
+void *editorSaveWorker(void *arg) {
+	struct savejob *job = arg;
+	uint64_t one = 1;
+
+	int ret = job->fd != -1 ? editorSaveInPlace(job) : editorSaveCopy(job);
+	job->err = ret == -1 ? errno : 0;
+	write(E.savefd, &one, sizeof(one));
+	return NULL;
+}
+
+
+//take a snapshot of the buffer and have a thread write it out, so the
+//editor keeps going however long that takes. the snapshot shares the
+//row tree, anything edited meanwhile is copied first (see rtUnshare)
+int editorSaveStart(char *filename) {
+	struct savejob *job = calloc(1, sizeof(struct savejob));
+	size_t prefix;
+
+	if (job == NULL)
+		return -1;
+	job->fd = -1;
+	//write through symlinks rather than replacing them
+	job->path = realpath(filename, NULL);
+	if (job->path == NULL)
+		job->path = strdup(filename);
+	if (job->path == NULL) {
+		free(job);
+		return -1;
+	}
+
+	//a search running in the background reads the rows without a
+	//snapshot, and saving in place rewrites them. one that is done
+	//keeps its matches, the text stays the same
+	findCancel();
+
+	//saving in place only pays off if most of the file stays as it is
+	editorCleanRows(&prefix);
+	if (E.inplace && E.map && prefix >= E.maplen / 2) {
+		struct stat st;
+		int fd = open(job->path, O_WRONLY);
+		if (fd != -1 && fstat(fd, &st) == 0 && st.st_dev == E.mapdev && st.st_ino == E.mapino) {
+			//lines after the first change are read from the very file
+			//being overwritten, so they are copied out first and the
+			//threads indexing it are stopped
+			int at;
+			triStop();
+			editorIndexRows(INT_MAX);
+			for (at = editorCleanRows(&prefix); at < E.numrows; at++)
+				editorRowMaterialize(editorRowEdit(at));
+			job->fd = fd;
+		} else if (fd != -1) {
+			close(fd);
+		}
+	}
+	if (job->fd == -1) {
+		job->exists = stat(job->path, &job->st) == 0;
+		mode_t mask = umask(0);
+		umask(mask);
+		job->mode = 0644 & ~mask;
+	}
+
+	editorRowCloseGap();
+	job->from = editorCleanRows(&job->prefix);
+	job->numrows = E.numrows;
+	job->root = E.rows;
+	if (job->root)
+		job->root->ref++;
+	job->tailoff = E.mapoff;
+	job->dirty = E.dirty;
+	journalFlush();
+	job->joff = E.jsize;
+	E.save = job;
+	job->threaded = pthread_create(&job->thread, NULL, editorSaveWorker, job) == 0;
+	if (!job->threaded)	//write it out right here then
+		editorSaveWorker(job);
+	return 0;
+}
+
+
+//wait for the save in progress, then let go of its snapshot and report
+void editorSaveDone() {
+	struct savejob *job = E.save;
+	int j;
+
+	if (job == NULL)
+		return;
+	if (job->threaded) {
+		uint64_t count;
+		pthread_join(job->thread, NULL);
+		//take its wake-up so it can't be mistaken for the next save's
+		if (read(E.savefd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+			die("read");
+	}
+	if (job->root)
+		rtRelease(job->root);
+	for (j = 0; j < job->nfreed; j++)
+		textFree(&job->freed[j]);
+	memFree(MEM_SAVE, job->freed);
+	E.save = NULL;
+
+	if (job->err == 0) {
+		//edits made while it was written leave the buffer modified
+		E.dirty -= job->dirty;
+		if (job->ownererr)
+			editorSetStatusMessage("%zu bytes written to disk, owner not kept: %s",
+								   job->total, strerror(job->ownererr));
+		else
+			editorSetStatusMessage("%zu bytes written to disk", job->total);
+		//the journal now goes on from the saved file. without one its
+		//records would miss whatever was typed during the save
+		struct stat st;
+		if (E.jpath == NULL)
+			E.jpath = journalPath(E.filename);
+		if ((E.jfd != -1 || E.dirty == 0) && stat(job->path, &st) == 0)
+			journalReset(&st, job->joff);
+	} else {
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+	}
+	free(job->path);
+	free(job);
+}
+
+
+//open file in editor
+void editorOpen(char *filename) {
+
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	//map regular files instead of reading them, lines are then indexed
+	//lazily as they are needed so even huge files show up immediately
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) die("open");
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			E.map = map;
+			E.maplen = st.st_size;
+			E.mapoff = 0;
+			E.mapfd = fd;
+			E.mapdev = st.st_dev;
+			E.mapino = st.st_ino;
+			E.dirtyrow = INT_MAX;
+			E.dirty = 0;
+			journalOpen(filename, &st);
+			triOpen(filename, &st);
+			return;
+		}
+	}
+
+	FILE *fp = fdopen(fd, "r");
+	if (!fp) die("fdopen");
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	
+	//keep reading until length of row read is 0, i.e. empty row reached end of file
+	E.uskip = 1;	//nothing to undo about loading the file
+	while ((linelen = getline(&line, &linecap, fp)) != -1) {
+
+		//calculate length of row read
+		while (linelen > 0 && (line[linelen - 1] == '\n' ||
+							   line[linelen - 1] == '\r'))
+			linelen--;
+		//add the new row to our existing array of rows, its text goes
+		//in the row if it is short or else in an arena with the rest of
+		//the file, rather than a malloc each
+		erow r;
+		r.size = linelen;
+		r.cls = 0;
+		if (linelen <= ROW_INLINE_MAX) {
+			r.flags = ROW_INLINE;
+			memcpy(editorRowText(&r), line, linelen);
+		} else {
+			r.flags = ROW_ARENA;
+			r.chars = textLoad(line, linelen);
+		}
+		editorPlaceRow(E.numrows, &r);
+
+	}
+	free(line);
+	fclose(fp);
+	E.uskip = 0;
+
+	//make number of changes to 0 on opening
+	E.dirty = 0;
+	journalOpen(filename, &st);
+}
+
+
+
+
+//write contents of editor into file and save
+void editorSave() {
+
+	//a save still running holds the older contents, let it finish first
+	editorSaveDone();
+
+	//if its a new file, prompt for a name from user
+  	if (E.filename == NULL) {
+  		//if user enters filename and presses enter, save file
+    	E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    	//if no name is returned, i.e. user pressed esc, abort save
+    	if (E.filename == NULL) {
+      		editorSetStatusMessage("Save aborted");
+      	return;
+    }
+  	}  
+
+  	if (editorSaveStart(E.filename) == -1)
+  		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+
+}
+
+
+
+
+
+
+
+
+
+
+/******************************* regex *******************************/
+
+//instructions of a compiled regex, and the nodes it is parsed into
+enum reOp {
+	RE_CLASS = 1,	//a byte of class 'cls', then the next instruction
+	RE_SPLIT,		//both x and y
+	RE_JMP,			//x
+	RE_BOL,			//the next instruction, at the start of a line
+	RE_EOL,			//the next instruction, at the end of one
+	RE_MATCH,
+	RE_EMPTY,		//nodes only from here on
+	RE_CAT,
+	RE_ALT,
+	RE_REPEAT
+};
+
+//flags of a dfa state
+#define RE_ACCEPT 1		//a match ends here
+#define RE_EOLACCEPT 2	//one ends here if this is the end of the line
+#define RE_DEAD 4		//no match can go on from here
+#define RE_EMPTYACCEPT 8	//one ends here if the line is empty
+
+struct reins {
+	int op;
+	int x, y;
+	int cls;
+};
+
+struct renode {
+	int op;
+	int l, r;       //operands of RE_CAT, RE_ALT and RE_REPEAT
+	int cls;
+	int min, max;   //of RE_REPEAT, max -1 for no limit
+};
+
+struct reprog {
+	struct reins *ins;
+	int n, cap;
+};
+
+//a dfa built lazily from a program, each state is the set of
+//instructions the program can be at. transitions are worked out the
+//first time they are taken, and the lot is thrown away when it fills up
+struct redfa {
+	struct reprog *prog;
+	int anchored;       //matches start where the scan does, not anywhere
+	int lines;          //'\n' and '\r' are left to reScan, see reState
+	int *set;           //instructions of every state back to back
+	size_t setlen, setcap;
+	size_t *setoff;     //where the ones of each state start
+	int *setn;
+	int *next;          //a row per state, its flags and then the row of the
+	                    //state reached on each byte group, -1 until known
+	int n;
+	int *hash;          //state + 1 by the hash of its set, 0 if free
+	int start[2];       //row of the start state away from and at the start
+	                    //of a line
+};
+
+//a regex compiled once as written, to find lines with a match and where
+//matches end, and once reversed, to find where they start
+struct regex {
+	struct renode *node;
+	int nnode, nodecap;
+	unsigned char (*cls)[32];   //bitmaps of the byte classes
+	int ncls, clscap;
+	int nocase;
+	const char *s;              //still to be parsed
+	struct reprog fwd, rev;
+	struct redfa udfa, fdfa, rdfa;  //unanchored, anchored and reversed
+	unsigned char bmap[256];    //bytes grouped by the classes they are in
+	unsigned char brep[256];    //a byte of each group
+	int nb;
+	int nl, cr;                 //groups of '\n' and '\r', which have their own
+	char *lit;                  //text every match contains, or NULL
+	int *mark, gen;             //instructions in the set being built
+	int *stack;
+	int *tmp, *tmp2;
+	unsigned char accel[4];     //bytes that end a run reSkip can skip
+	int naccel;                 //0 if there are too many of them
+	unsigned char isaccel[256];
+};
+
+
+int reNode(struct regex *re, int op, int l, int r) {
+	if (re->nnode == re->nodecap) {
+		int cap = re->nodecap ? re->nodecap * 2 : 64;
+		struct renode *node = memRealloc(MEM_SEARCH, re->node, cap * sizeof(struct renode));
+		if (node == NULL)
+			return -1;
+		re->node = node;
+		re->nodecap = cap;
+	}
+	struct renode *nd = &re->node[re->nnode];
+	memset(nd, 0, sizeof(*nd));
+	nd->op = op;
+	nd->l = l;
+	nd->r = r;
+	return re->nnode++;
+}
+
+
+//a node for a new, empty byte class
+int reClassNode(struct regex *re) {
+	if (re->ncls == re->clscap) {
+		int cap = re->clscap ? re->clscap * 2 : 16;
+		unsigned char (*cls)[32] = memRealloc(MEM_SEARCH, re->cls, cap * sizeof(*cls));
+		if (cls == NULL)
+			return -1;
+		re->cls = cls;
+		re->clscap = cap;
+	}
+	int nd = reNode(re, RE_CLASS, -1, -1);
+	if (nd < 0)
+		return -1;
+	memset(re->cls[re->ncls], 0, 32);
+	re->node[nd].cls = re->ncls++;
+	return nd;
+}
+
+
+void reSetBit(unsigned char *bits, int c) {
+	bits[c / 8] |= 1 << (c % 8);
+}
+
+int reHasBit(const unsigned char *bits, int c) {
+	return bits[c / 8] & (1 << (c % 8));
+}
+
+
+//add the bytes of \d, \w or \s, or those their capitals stand for, to
+//a class. returns 0 if 'c' is none of them
+int reShorthand(unsigned char *bits, int c) {
+	int i, neg = isupper(c);
+
+	if (strchr("dws", tolower(c)) == NULL)
+		return 0;
+	for (i = 0; i < 256; i++) {
+		int in;
+		if (tolower(c) == 'd')
+			in = isdigit(i);
+		else if (tolower(c) == 'w')
+			in = isalnum(i) || i == '_';
+		else
+			in = i == ' ' || (i >= '\t' && i <= '\r' && i != '\n');
+		if (neg ? !in && i != '\n' : in)
+			reSetBit(bits, i);
+	}
+	return 1;
+}
+
+
+//what an escaped character stands for
+int reEscape(int c) {
+	switch (c) {
+		case 't': return '\t';
+		case 'r': return '\r';
+		case 'f': return '\f';
+		case 'v': return '\v';
+		default: return c;
+	}
+}
+
+
+//letters of a class stand for both cases if case doesn't matter
+void reFold(struct regex *re, unsigned char *bits) {
+	int c;
+	if (!re->nocase)
+		return;
+	for (c = 'A'; c <= 'Z'; c++) {
+		if (reHasBit(bits, c) || reHasBit(bits, c | 0x20)) {
+			reSetBit(bits, c);
+			reSetBit(bits, c | 0x20);
+		}
+	}
+}
+
+
+//[...] after the '['
+int reParseClass(struct regex *re) {
+	int nd = reClassNode(re);
+	int neg = 0, first = 1, c, i;
+	if (nd < 0)
+		return -1;
+	unsigned char *bits = re->cls[re->node[nd].cls];
+
+	if (*re->s == '^') {
+		neg = 1;
+		re->s++;
+	}
+	while (*re->s && (*re->s != ']' || first)) {
+		int lo = (unsigned char)*re->s++, hi;
+		first = 0;
+		if (lo == '\\' && *re->s) {
+			if (reShorthand(bits, *re->s)) {
+				re->s++;
+				continue;
+			}
+			lo = reEscape((unsigned char)*re->s++);
+		}
+		hi = lo;
+		if (re->s[0] == '-' && re->s[1] && re->s[1] != ']') {
+			re->s++;
+			hi = (unsigned char)*re->s++;
+			if (hi == '\\' && *re->s)
+				hi = reEscape((unsigned char)*re->s++);
+			if (hi < lo)
+				return -1;
+		}
+		for (c = lo; c <= hi; c++)
+			reSetBit(bits, c);
+	}
+	if (*re->s != ']')
+		return -1;
+	re->s++;
+	reFold(re, bits);
+	if (neg) {
+		for (i = 0; i < 32; i++)
+			bits[i] = ~bits[i];
+		bits['\n' / 8] &= ~(1 << ('\n' % 8));
+	}
+	return nd;
+}
+
+
+int reParseAlt(struct regex *re);
+
+//a single character, a class, an anchor or a group
+int reParseAtom(struct regex *re) {
+	int c = (unsigned char)*re->s++;
+	int nd, i;
+
+	switch (c) {
+		case '(':
+			nd = reParseAlt(re);
+			if (nd < 0 || *re->s != ')')
+				return -1;
+			re->s++;
+			return nd;
+		case '[':
+			return reParseClass(re);
+		case '^':
+			return reNode(re, RE_BOL, -1, -1);
+		case '$':
+			return reNode(re, RE_EOL, -1, -1);
+		case '*': case '+': case '?':	//nothing to repeat
+			return -1;
+	}
+	nd = reClassNode(re);
+	if (nd < 0)
+		return -1;
+	unsigned char *bits = re->cls[re->node[nd].cls];
+	if (c == '.') {
+		for (i = 0; i < 32; i++)
+			bits[i] = 0xff;
+		bits['\n' / 8] &= ~(1 << ('\n' % 8));
+		return nd;
+	}
+	if (c == '\\') {
+		if (*re->s == '\0')
+			return -1;
+		c = (unsigned char)*re->s++;
+		if (reShorthand(bits, c))
+			return nd;
+		c = reEscape(c);
+	}
+	reSetBit(bits, c);
+	reFold(re, bits);
+	return nd;
+}
+
+
+//a count in {m,n}. one too big to fit an int becomes RE_MAX_REPEAT + 1,
+//so it is turned down with the others above the limit
+int reParseCount(const char *s, char **end) {
+	errno = 0;
+	long n = strtol(s, end, 10);
+	if (errno == ERANGE || n > RE_MAX_REPEAT)
+		return RE_MAX_REPEAT + 1;
+	return n;
+}
+
+
+//{m}, {m,} or {m,n} after the '{', -1 if it isn't one of them
+int reParseBounds(struct regex *re, int *min, int *max) {
+	const char *s = re->s;
+	char *end;
+
+	if (!isdigit((unsigned char)*s))
+		return -1;
+	*min = *max = reParseCount(s, &end);
+	s = end;
+	if (*s == ',') {
+		s++;
+		*max = -1;
+		if (isdigit((unsigned char)*s)) {
+			*max = reParseCount(s, &end);
+			s = end;
+		}
+	}
+	if (*s != '}')
+		return -1;
+	re->s = s + 1;
+	return 0;
+}
+
+
+//an atom and whatever says how often it repeats
+int reParseRepeat(struct regex *re) {
+	int nd = reParseAtom(re);
+	while (nd >= 0) {
+		int min, max;
+		if (*re->s == '*') {
+			min = 0, max = -1;
+		} else if (*re->s == '+') {
+			min = 1, max = -1;
+		} else if (*re->s == '?') {
+			min = 0, max = 1;
+		} else if (*re->s == '{') {
+			re->s++;
+			if (reParseBounds(re, &min, &max) == -1) {
+				re->s--;	//a plain '{' then
+				break;
+			}
+			if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max != -1 && max < min))
+				return -1;
+			re->s--;
+		} else {
+			break;
+		}
+		re->s++;
+		nd = reNode(re, RE_REPEAT, nd, -1);
+		if (nd >= 0) {
+			re->node[nd].min = min;
+			re->node[nd].max = max;
+		}
+	}
+	return nd;
+}
+
+
+//what comes one after the other up to a '|' or a ')'
+int reParseCat(struct regex *re) {
+	int nd = reNode(re, RE_EMPTY, -1, -1);
+	while (nd >= 0 && *re->s && *re->s != '|' && *re->s != ')') {
+		int r = reParseRepeat(re);
+		nd = r < 0 ? -1 : reNode(re, RE_CAT, nd, r);
+	}
+	return nd;
+}
+
+
+int reParseAlt(struct regex *re) {
+	int nd = reParseCat(re);
+	while (nd >= 0 && *re->s == '|') {
+		re->s++;
+		int r = reParseCat(re);
+		nd = r < 0 ? -1 : reNode(re, RE_ALT, nd, r);
+	}
+	return nd;
+}
+
+
+int reIns(struct reprog *p, int op, int x, int y, int cls) {
+	if (p->n == p->cap) {
+		int cap = p->cap ? p->cap * 2 : 64;
+		struct reins *ins;
+		if (cap > RE_MAX_INS || (ins = memRealloc(MEM_SEARCH, p->ins, cap * sizeof(struct reins))) == NULL)
+			return -1;
+		p->ins = ins;
+		p->cap = cap;
+	}
+	p->ins[p->n].op = op;
+	p->ins[p->n].x = x;
+	p->ins[p->n].y = y;
+	p->ins[p->n].cls = cls;
+	return p->n++;
+}
+
+
+//instructions for node 'nd', read backwards if 'rev'
+int reEmit(struct regex *re, struct reprog *p, int nd, int rev) {
+	struct renode n = re->node[nd];
+	int i, j, k;
+
+	switch (n.op) {
+		case RE_EMPTY:
+			return 0;
+		case RE_CLASS:
+			return reIns(p, RE_CLASS, 0, 0, n.cls) < 0 ? -1 : 0;
+		case RE_BOL:
+		case RE_EOL:	//backwards the start of a line is where it ends
+			return reIns(p, (n.op == RE_BOL) != rev ? RE_BOL : RE_EOL, 0, 0, 0) < 0 ? -1 : 0;
+		case RE_CAT:
+			if (reEmit(re, p, rev ? n.r : n.l, rev) < 0)
+				return -1;
+			return reEmit(re, p, rev ? n.l : n.r, rev);
+		case RE_ALT:
+			if ((i = reIns(p, RE_SPLIT, 0, 0, 0)) < 0 || reEmit(re, p, n.l, rev) < 0 ||
+				(j = reIns(p, RE_JMP, 0, 0, 0)) < 0)
+				return -1;
+			p->ins[i].x = i + 1;
+			p->ins[i].y = p->n;
+			if (reEmit(re, p, n.r, rev) < 0)
+				return -1;
+			p->ins[j].x = p->n;
+			return 0;
+	}
+	//RE_REPEAT, written out min times and then once more for each
+	//optional one, or in a loop if there is no limit
+	for (k = 0; k < n.min; k++)
+		if (reEmit(re, p, n.l, rev) < 0)
+			return -1;
+	for (k = n.min; k < (n.max == -1 ? n.min + 1 : n.max); k++) {
+		if ((i = reIns(p, RE_SPLIT, 0, 0, 0)) < 0 || reEmit(re, p, n.l, rev) < 0)
+			return -1;
+		if (n.max == -1 && reIns(p, RE_JMP, i, 0, 0) < 0)
+			return -1;
+		p->ins[i].x = i + 1;
+		p->ins[i].y = p->n;
+	}
+	return 0;
+}
+
+
+//the longest run of single characters one after the other at the top
+//of the regex, which any match has to contain
+void reFindLiteral(struct regex *re, int root) {
+	char run[RE_MAX_LITERAL + 1], best[RE_MAX_LITERAL + 1];
+	int nrun = 0, nbest = 0;
+	int items[RE_MAX_LITERAL * 4];
+	int nitems = 0, nd, i, c;
+
+	//a regex parses into a left leaning chain of RE_CAT
+	for (nd = root; re->node[nd].op == RE_CAT; nd = re->node[nd].l)
+		if (nitems < (int)(sizeof(items) / sizeof(items[0])))
+			items[nitems++] = re->node[nd].r;
+	if (re->node[nd].op != RE_EMPTY)
+		return;
+	for (i = nitems - 1; i >= -1; i--) {
+		int ch = -1;
+		if (i >= 0 && re->node[items[i]].op == RE_CLASS) {
+			const unsigned char *bits = re->cls[re->node[items[i]].cls];
+			int count = 0;
+			for (c = 0; c < 256; c++)
+				if (reHasBit(bits, c) && count++ == 0)
+					ch = c;
+			if (count == 2 && re->nocase && isupper(ch) && reHasBit(bits, ch | 0x20))
+				ch |= 0x20;
+			else if (count != 1)
+				ch = -1;
+		}
+		if (ch != -1 && nrun < RE_MAX_LITERAL) {
+			run[nrun++] = ch;
+			continue;
+		}
+		if (nrun > nbest) {
+			memcpy(best, run, nrun);
+			nbest = nrun;
+		}
+		nrun = 0;
+		if (ch != -1)
+			run[nrun++] = ch;
+	}
+	if (nbest >= RE_MIN_LITERAL && (re->lit = memAlloc(MEM_SEARCH, nbest + 1)) != NULL) {
+		memcpy(re->lit, best, nbest);
+		re->lit[nbest] = '\0';
+	}
+}
+
+
+//split the bytes into groups no class tells apart, transitions are
+//kept for each group rather than for each byte
+void reGroupBytes(struct regex *re) {
+	int map[512];
+	int c, k, n;
+
+	memset(re->bmap, 0, sizeof(re->bmap));
+	re->bmap['\n'] = 1;
+	re->bmap['\r'] = 2;
+	re->nb = 3;
+	for (k = 0; k < re->ncls; k++) {
+		for (c = 0; c < 512; c++)
+			map[c] = -1;
+		n = 0;
+		for (c = 0; c < 256; c++) {
+			int key = re->bmap[c] * 2 + !!reHasBit(re->cls[k], c);
+			if (map[key] == -1)
+				map[key] = n++;
+			re->bmap[c] = map[key];
+		}
+		re->nb = n;
+	}
+	for (c = 255; c >= 0; c--)
+		re->brep[re->bmap[c]] = c;
+	re->nl = re->bmap['\n'];
+	re->cr = re->bmap['\r'];
+}
+
+
+int reDfaInit(struct regex *re, struct redfa *d, struct reprog *p, int anchored, int lines) {
+	memset(d, 0, sizeof(*d));
+	d->prog = p;
+	d->anchored = anchored;
+	d->lines = lines;
+	d->start[0] = d->start[1] = -1;
+	d->setoff = memAlloc(MEM_SEARCH, RE_MAX_STATES * sizeof(size_t));
+	d->setn = memAlloc(MEM_SEARCH, RE_MAX_STATES * sizeof(int));
+	d->next = memAlloc(MEM_SEARCH, (size_t)RE_MAX_STATES * (re->nb + 1) * sizeof(int));
+	d->hash = memCalloc(MEM_SEARCH, RE_MAX_STATES * 2, sizeof(int));
+	return d->setoff && d->setn && d->next && d->hash ? 0 : -1;
+}
+
+
+void reDfaFree(struct redfa *d) {
+	memFree(MEM_SEARCH, d->set);
+	memFree(MEM_SEARCH, d->setoff);
+	memFree(MEM_SEARCH, d->setn);
+	memFree(MEM_SEARCH, d->next);
+	memFree(MEM_SEARCH, d->hash);
+}
+
+
+void reFree(struct regex *re) {
+	if (re == NULL)
+		return;
+	reDfaFree(&re->udfa);
+	reDfaFree(&re->fdfa);
+	reDfaFree(&re->rdfa);
+	memFree(MEM_SEARCH, re->fwd.ins);
+	memFree(MEM_SEARCH, re->rev.ins);
+	memFree(MEM_SEARCH, re->node);
+	memFree(MEM_SEARCH, re->cls);
+	memFree(MEM_SEARCH, re->lit);
+	memFree(MEM_SEARCH, re->mark);
+	memFree(MEM_SEARCH, re->stack);
+	memFree(MEM_SEARCH, re->tmp);
+	memFree(MEM_SEARCH, re->tmp2);
+	memFree(MEM_SEARCH, re);
+}
+
+
+//add instruction i to a set and whatever it leads to without taking a
+//byte. RE_BOL and RE_EOL only let through what 'bol' and 'eol' allow,
+//otherwise an RE_EOL stays in the set to be tried at the end of the line
+void reClosure(struct regex *re, struct reprog *p, int i, int bol, int eol, int *set, int *n) {
+	int sp = 0;
+	re->stack[sp++] = i;
+	while (sp > 0) {
+		i = re->stack[--sp];
+		if (re->mark[i] == re->gen)
+			continue;
+		re->mark[i] = re->gen;
+		switch (p->ins[i].op) {
+			case RE_SPLIT:
+				re->stack[sp++] = p->ins[i].y;
+				re->stack[sp++] = p->ins[i].x;
+				break;
+			case RE_JMP:
+				re->stack[sp++] = p->ins[i].x;
+				break;
+			case RE_BOL:
+				if (bol)
+					re->stack[sp++] = i + 1;
+				break;
+			case RE_EOL:
+				if (eol) {
+					re->stack[sp++] = i + 1;
+					break;
+				}
+				//fall through
+			default:
+				set[(*n)++] = i;
+		}
+	}
+}
+
+
+//the bytes that take a scan out of the state it idles in, where no
+//match is under way. if there are few of them reScan skips from one to
+//the next with reSkip rather than stepping through the dfa
+void reAccel(struct regex *re) {
+	struct reprog *p = &re->fwd;
+	int *idle = re->tmp2;
+	int nidle = 0, n, i, c;
+
+	re->gen++;
+	reClosure(re, p, 0, 0, 0, idle, &nidle);
+	re->naccel = 0;
+	for (c = 0; c < 256; c++) {
+		//anything the byte leads to that isn't in the idle set
+		re->gen++;
+		for (i = 0; i < nidle; i++)
+			re->mark[idle[i]] = re->gen;
+		n = 0;
+		for (i = 0; i < nidle; i++)
+			if (p->ins[idle[i]].op == RE_CLASS && reHasBit(re->cls[p->ins[idle[i]].cls], c))
+				reClosure(re, p, idle[i] + 1, 0, 0, re->tmp, &n);
+		if (n == 0 && c != '\n' && c != '\r')
+			continue;
+		if (re->naccel == 4) {
+			re->naccel = 0;
+			return;
+		}
+		re->accel[re->naccel++] = c;
+	}
+	for (i = 0; i < re->naccel; i++)
+		re->isaccel[re->accel[i]] = 1;
+	for (i = re->naccel; i < 4; i++)	//so the vector loop can compare with all four
+		re->accel[i] = re->accel[0];
+}
+
+
+//compile a regex, NULL if it isn't one. supported are . [] [^] ^ $ ()
+//| * + ? {m,n} and \d \w \s with their capitals
+struct regex *reCompile(const char *s, int nocase) {
+	struct regex *re = memCalloc(MEM_SEARCH, 1, sizeof(struct regex));
+	int root, n;
+
+	if (re == NULL)
+		return NULL;
+	re->nocase = nocase;
+	re->s = s;
+	root = reParseAlt(re);
+	if (root < 0 || *re->s != '\0' ||	//a ')' without its '('
+		reEmit(re, &re->fwd, root, 0) < 0 || reIns(&re->fwd, RE_MATCH, 0, 0, 0) < 0 ||
+		reEmit(re, &re->rev, root, 1) < 0 || reIns(&re->rev, RE_MATCH, 0, 0, 0) < 0) {
+		reFree(re);
+		return NULL;
+	}
+	reFindLiteral(re, root);
+	reGroupBytes(re);
+	memFree(MEM_SEARCH, re->node);
+	re->node = NULL;
+
+	n = re->fwd.n > re->rev.n ? re->fwd.n : re->rev.n;
+	re->mark = memCalloc(MEM_SEARCH, n, sizeof(int));
+	re->stack = memAlloc(MEM_SEARCH, 2 * n * sizeof(int));
+	re->tmp = memAlloc(MEM_SEARCH, n * sizeof(int));
+	re->tmp2 = memAlloc(MEM_SEARCH, n * sizeof(int));
+	if (re->mark == NULL || re->stack == NULL || re->tmp == NULL || re->tmp2 == NULL ||
+		reDfaInit(re, &re->udfa, &re->fwd, 0, 1) < 0 ||
+		reDfaInit(re, &re->fdfa, &re->fwd, 1, 0) < 0 || reDfaInit(re, &re->rdfa, &re->rev, 0, 0) < 0) {
+		reFree(re);
+		return NULL;
+	}
+	reAccel(re);
+	return re;
+}
+
+
+int reCompareInt(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+
+//the state for a set of instructions, -1 once the dfa is full
+int reState(struct regex *re, struct redfa *d, int *set, int n) {
+	struct reprog *p = d->prog;
+	unsigned h = 2166136261u;
+	int i, k, flags = 0;
+
+	qsort(set, n, sizeof(int), reCompareInt);
+	for (i = 0; i < n; i++)
+		h = (h ^ set[i]) * 16777619u;
+	for (k = h & (RE_MAX_STATES * 2 - 1); d->hash[k]; k = (k + 1) & (RE_MAX_STATES * 2 - 1)) {
+		int s = d->hash[k] - 1;
+		if (d->setn[s] == n && memcmp(d->set + d->setoff[s], set, n * sizeof(int)) == 0)
+			return s;
+	}
+	if (d->n == RE_MAX_STATES)
+		return -1;
+	if (d->setlen + n > d->setcap) {
+		size_t cap = d->setcap ? d->setcap * 2 : 1024;
+		while (cap < d->setlen + n)
+			cap *= 2;
+		int *all = memRealloc(MEM_SEARCH, d->set, cap * sizeof(int));
+		if (all == NULL)
+			die("realloc");
+		d->set = all;
+		d->setcap = cap;
+	}
+
+	//does it match, right away, at the end of the line, or where the
+	//line ends as soon as it starts
+	int bol, m;
+	for (bol = 0; bol < 2; bol++) {
+		re->gen++;
+		m = 0;
+		for (i = 0; i < n; i++) {
+			if (p->ins[set[i]].op == RE_MATCH)
+				flags |= RE_ACCEPT;
+			else if (p->ins[set[i]].op == RE_EOL)
+				reClosure(re, p, set[i] + 1, bol, 1, re->tmp2, &m);
+		}
+		for (i = 0; i < m; i++)
+			if (p->ins[re->tmp2[i]].op == RE_MATCH)
+				flags |= bol ? RE_EMPTYACCEPT : RE_EOLACCEPT;
+	}
+	if (n == 0)
+		flags |= RE_DEAD;
+
+	int s = d->n++;
+	memcpy(d->set + d->setlen, set, n * sizeof(int));
+	d->setoff[s] = d->setlen;
+	d->setn[s] = n;
+	d->setlen += n;
+	int *row = d->next + (size_t)s * (re->nb + 1);
+	row[0] = flags;
+	for (i = 1; i <= re->nb; i++)
+		row[i] = -1;
+	if (d->lines) {	//-2 sends the scan to see if the line ends
+		row[1 + re->nl] = -2;
+		row[1 + re->cr] = -2;
+	}
+	d->hash[k] = s + 1;
+	return s;
+}
+
+
+//start over with an empty dfa
+void reFlush(struct redfa *d) {
+	d->n = 0;
+	d->setlen = 0;
+	d->start[0] = d->start[1] = -1;
+	memset(d->hash, 0, RE_MAX_STATES * 2 * sizeof(int));
+}
+
+
+//the row of the state a scan starts in, at the start of a line or not
+int reStart(struct regex *re, struct redfa *d, int bol) {
+	if (d->start[bol] == -1) {
+		int n = 0, s;
+		re->gen++;
+		reClosure(re, d->prog, 0, bol, 0, re->tmp, &n);
+		if ((s = reState(re, d, re->tmp, n)) == -1) {
+			reFlush(d);
+			s = reState(re, d, re->tmp, n);
+		}
+		d->start[bol] = s * (re->nb + 1);
+	}
+	return d->start[bol];
+}
+
+
+//the row of the state after taking a byte of group b in the state at
+//row r
+int reNext(struct regex *re, struct redfa *d, int r, int b) {
+	struct reprog *p = d->prog;
+	int s = r / (re->nb + 1);
+	int *set = d->set + d->setoff[s];
+	int i, n = 0, t;
+
+	re->gen++;
+	for (i = 0; i < d->setn[s]; i++) {
+		struct reins *in = &p->ins[set[i]];
+		if (in->op == RE_CLASS && reHasBit(re->cls[in->cls], re->brep[b]))
+			reClosure(re, p, set[i] + 1, 0, 0, re->tmp, &n);
+	}
+	if (!d->anchored)	//a match may start at every byte
+		reClosure(re, p, 0, 0, 0, re->tmp, &n);
+	if ((t = reState(re, d, re->tmp, n)) == -1) {
+		reFlush(d);
+		return reState(re, d, re->tmp, n) * (re->nb + 1);
+	}
+	t *= re->nb + 1;
+	if (d->next[r + 1 + b] == -1)
+		d->next[r + 1 + b] = t;
+	return t;
+}
+
+
+//index of the first of the bytes reAccel found in text[i..len), or len
+size_t reSkip(struct regex *re, const char *text, size_t i, size_t len) {
+#ifdef SCRIB_X86
+	const __m128i a = _mm_set1_epi8(re->accel[0]);
+	const __m128i b = _mm_set1_epi8(re->accel[1]);
+	const __m128i c = _mm_set1_epi8(re->accel[2]);
+	const __m128i d = _mm_set1_epi8(re->accel[3]);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+								 _mm_or_si128(_mm_cmpeq_epi8(v, c), _mm_cmpeq_epi8(v, d)));
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len; i++)
+		if (re->isaccel[(unsigned char)text[i]])
+			return i;
+	return len;
+}
+
+
+//the start of the first line in text[from..len) with a match in it, or
+//-1. only the part of the line from 'from' on counts for the first one
+long reScan(struct regex *re, const char *text, size_t from, size_t len) {
+	struct redfa *d = &re->udfa;
+	const int *next = d->next;	//next[r] is the flags of the state at row r
+	int bol = from == 0 || text[from - 1] == '\n';
+	int r, idle;
+	size_t i, ls = from;
+
+	idle = reStart(re, d, 0);	//the state reSkip is for
+	r = reStart(re, d, bol);
+
+	if (next[r] & RE_ACCEPT)
+		return ls;
+	for (i = from; i < len; i++) {
+		if (r == idle && re->naccel) {
+			i = reSkip(re, text, i, len);
+			if (i == len)
+				break;
+		}
+		int b = re->bmap[(unsigned char)text[i]];
+		int t = next[r + 1 + b];
+		if (t == -2 && (text[i] == '\n' || (i + 1 < len && text[i + 1] == '\n'))) {
+			if (next[r] & (i == ls && bol ? RE_EOLACCEPT | RE_EMPTYACCEPT : RE_EOLACCEPT))
+				return ls;
+			if (text[i] == '\r')
+				i++;
+			ls = i + 1;
+			bol = 1;
+			r = reStart(re, d, 1);
+			idle = reStart(re, d, 0);
+			if (next[r] & RE_ACCEPT)
+				return ls;
+			continue;
+		}
+		if (t < 0) {	//a '\r' on its own is just a byte
+			t = reNext(re, d, r, b);
+			if (d->start[0] == -1)	//thrown away, the idle state is needed
+				idle = reStart(re, d, 0);
+		}
+		r = t;
+		if (next[r] & RE_ACCEPT)
+			return ls;
+	}
+	if (next[r] & (i == ls && bol ? RE_EOLACCEPT | RE_EMPTYACCEPT : RE_EOLACCEPT))
+		return ls;
+	return -1;
+}
+
+
+//where the first match starts in text[0..n], -1 if none does. the text
+//ends where a line does and starts where one does if 'bol'. it is read
+//backwards, so a match anywhere is seen as the scan passes its start
+long reFirst(struct regex *re, const char *text, size_t n, int bol) {
+	struct redfa *d = &re->rdfa;
+	int r = reStart(re, d, 1);
+	long first = -1;
+	size_t i = n;
+	const int *next = d->next;
+
+	if (next[r] & (n == 0 && bol ? RE_ACCEPT | RE_EOLACCEPT | RE_EMPTYACCEPT : RE_ACCEPT))
+		first = n;
+	while (i > 1) {
+		int b = re->bmap[(unsigned char)text[--i]];
+		int t = next[r + 1 + b];
+		r = t >= 0 ? t : reNext(re, d, r, b);
+		if (next[r] & RE_ACCEPT)
+			first = i;
+	}
+	if (i == 1) {	//the start of the line can be an anchor
+		int b = re->bmap[(unsigned char)text[0]];
+		int t = next[r + 1 + b];
+		r = t >= 0 ? t : reNext(re, d, r, b);
+		if (next[r] & (bol ? RE_ACCEPT | RE_EOLACCEPT : RE_ACCEPT))
+			first = 0;
+	}
+	return first;
+}
+
+
+//length of the longest match starting at text[0], text[0..n] being the
+//rest of a line
+size_t reLongest(struct regex *re, const char *text, size_t n, int bol) {
+	struct redfa *d = &re->fdfa;
+	int r = reStart(re, d, bol);
+	size_t i, len = 0;
+
+	for (i = 0; ; i++) {
+		if (d->next[r] & (i < n ? RE_ACCEPT : n == 0 && bol ?
+						  RE_ACCEPT | RE_EOLACCEPT | RE_EMPTYACCEPT : RE_ACCEPT | RE_EOLACCEPT))
+			len = i;
+		if (i == n || (d->next[r] & RE_DEAD))
+			break;
+		int b = re->bmap[(unsigned char)text[i]];
+		int t = d->next[r + 1 + b];
+		r = t >= 0 ? t : reNext(re, d, r, b);
+	}
+	return len;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* trigram index *******************************/
+
+//which trigrams each TRI_CHUNK bytes of the mapped file hold, hashed into
+//a bitmap a chunk, so a search can pass over chunks that can't have a
+//match in them. the bitmap of a chunk takes in the TRI_SPAN bytes after
+//it too, a match starting in the chunk is then covered by it alone.
+//threads build it in the background, each chunk is used once it is done.
+//edits never change the mapping, an edited row gets a copy of its own
+//and is searched on its own, so the index stays right as it is
+struct triindex {
+	size_t nchunks;
+	uint64_t *bits;         //TRI_WORDS words for each chunk
+	unsigned char *ready;   //chunks whose bits are all set
+	char *cache;            //the cache file the bits are in, if read from one
+	size_t cachelen;
+	char *path;             //cache file, NULL if none is kept
+	struct stat st;         //the file indexed, the cache has to be of it
+	size_t next;            //first chunk no thread has taken yet
+	int cancel;             //set to make the threads give up
+	int running;            //threads that haven't finished
+	int nthreads;
+	pthread_t thread[SCAN_MAX_THREADS];
+};
+
+//the cache starts with this, the bits of every chunk follow
+struct triHeader {
+	char magic[8];
+	uint64_t size;          //size and mtime of the file it is an index of
+	int64_t mtime;
+	int64_t mtimens;
+	uint64_t chunk;         //TRI_CHUNK and TRI_LOG_BITS when it was built
+	uint64_t logbits;
+};
+
+//bits of the trigrams a query's matches start with
+struct triquery {
+	uint32_t bit[TRI_SPAN - 2];
+	int n;
+};
+
+
+//ascii letters are lowered, so one index does for either case
+unsigned char triLower(unsigned char c) {
+	return (unsigned)(c - 'A') < 26 ? c + 32 : c;
+}
+
+
+//bit of the trigram in the low three bytes of v
+uint32_t triHash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - TRI_LOG_BITS);
+}
+
+
+//name of the cache of 'filename', a hidden .tri file next to it
+char *triPath(char *filename) {
+	char *slash = strrchr(filename, '/');
+	int dirlen = slash ? slash - filename + 1 : 0;
+	char *path = malloc(strlen(filename) + 6);
+	if (path == NULL) die("malloc");
+	sprintf(path, "%.*s.%s.tri", dirlen, filename, filename + dirlen);
+	return path;
+}
+
+
+//set the bits of chunk k, from the trigrams of its bytes and the
+//TRI_SPAN after it. a byte per bit first, setting those doesn't have to
+//wait on the last store to the same word
+void triChunk(struct triindex *t, size_t k) {
+	unsigned char seen[1 << TRI_LOG_BITS];
+	uint64_t *w = t->bits + k * TRI_WORDS;
+	size_t i = k * TRI_CHUNK;
+	size_t end = i + TRI_CHUNK + TRI_SPAN;
+	uint32_t v;
+	int j, b;
+
+	if (end > E.maplen)
+		end = E.maplen;
+	memset(seen, 0, sizeof(seen));
+	if (end - i >= 3) {
+		v = triLower(E.map[i]) << 8 | triLower(E.map[i + 1]);
+		for (i += 2; i < end; i++) {
+			v = (v << 8 | triLower(E.map[i])) & 0xffffff;
+			seen[triHash(v)] = 1;
+		}
+	}
+	for (j = 0; j < TRI_WORDS; j++) {
+		uint64_t word = 0;
+		for (b = 0; b < 64; b++)
+			word |= (uint64_t)seen[j * 64 + b] << b;
+		w[j] = word;
+	}
+	__atomic_store_n(&t->ready[k], 1, __ATOMIC_RELEASE);
+}
+
+
+//write the index to its cache, through a temporary file renamed over it
+//so that a cache is never read half written
+void triSave(struct triindex *t) {
+	size_t len = t->nchunks * TRI_WORDS * sizeof(uint64_t), off = 0;
+	struct triHeader h;
+	int fd, ok;
+
+	char *tmp = malloc(strlen(t->path) + 8);
+	if (tmp == NULL)
+		return;
+	sprintf(tmp, "%s.XXXXXX", t->path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(tmp);
+		return;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRI_MAGIC, sizeof(h.magic));
+	h.size = t->st.st_size;
+	h.mtime = t->st.st_mtim.tv_sec;
+	h.mtimens = t->st.st_mtim.tv_nsec;
+	h.chunk = TRI_CHUNK;
+	h.logbits = TRI_LOG_BITS;
+	ok = write(fd, &h, sizeof(h)) == sizeof(h);
+	while (ok && off < len && !__atomic_load_n(&t->cancel, __ATOMIC_RELAXED)) {
+		ssize_t w = write(fd, (char *)t->bits + off, len - off < SCAN_BLOCK ? len - off : SCAN_BLOCK);
+		if (w == -1 && errno == EINTR)
+			continue;
+		ok = w > 0;
+		off += ok ? w : 0;
+	}
+	if (close(fd) == -1 || off < len || rename(tmp, t->path) == -1)
+		unlink(tmp);
+	free(tmp);
+}
+
+
+//take the bits from the cache, if it is there and of this very file
+int triLoad(struct triindex *t) {
+	size_t len = sizeof(struct triHeader) + t->nchunks * TRI_WORDS * sizeof(uint64_t);
+	struct stat st;
+
+	int fd = open(t->path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != len) {
+		close(fd);
+		return -1;
+	}
+	char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	struct triHeader *h = (struct triHeader *)map;
+	if (memcmp(h->magic, TRI_MAGIC, sizeof(h->magic)) != 0 ||
+		h->size != (uint64_t)t->st.st_size || h->mtime != t->st.st_mtim.tv_sec ||
+		h->mtimens != t->st.st_mtim.tv_nsec || h->chunk != TRI_CHUNK || h->logbits != TRI_LOG_BITS) {
+		munmap(map, len);
+		return -1;
+	}
+	t->cache = map;
+	t->cachelen = len;
+	t->bits = (uint64_t *)(map + sizeof(struct triHeader));
+	memset(t->ready, 1, t->nchunks);
+	return 0;
+}
+
+
+//thread building the index, the last one to finish writes the cache
+void *triWorker(void *arg) {
+	struct triindex *t = arg;
+	size_t k;
+
+	while (!__atomic_load_n(&t->cancel, __ATOMIC_RELAXED) &&
+		   (k = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED)) < t->nchunks)
+		triChunk(t, k);
+	if (__atomic_sub_fetch(&t->running, 1, __ATOMIC_ACQ_REL) == 0 && t->path &&
+		!__atomic_load_n(&t->cancel, __ATOMIC_RELAXED))
+		triSave(t);
+	return NULL;
+}
+
+
+//index the file just mapped by editorOpen in the background, or take
+//the index from its cache
+void triOpen(char *filename, struct stat *st) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = ncpu > 0 ? (ncpu > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : ncpu) : 1;
+	struct triindex *t;
+	int i;
+
+	if (E.map == NULL || E.maplen < E.trimin || (t = memCalloc(MEM_SEARCH, 1, sizeof(struct triindex))) == NULL)
+		return;
+	t->nchunks = (E.maplen + TRI_CHUNK - 1) / TRI_CHUNK;
+	t->st = *st;
+	t->ready = memCalloc(MEM_SEARCH, t->nchunks, 1);
+	if (E.tricache)
+		t->path = triPath(filename);
+	if (t->ready && t->path && triLoad(t) == 0) {
+		E.tri = t;
+		return;
+	}
+	t->bits = memCalloc(MEM_SEARCH, t->nchunks * TRI_WORDS, sizeof(uint64_t));
+	if (t->ready == NULL || t->bits == NULL) {
+		memFree(MEM_SEARCH, t->ready);
+		memFree(MEM_SEARCH, t->bits);
+		free(t->path);
+		memFree(MEM_SEARCH, t);
+		return;
+	}
+	if ((size_t)nthreads > t->nchunks)
+		nthreads = t->nchunks;
+
+	E.tri = t;
+	t->running = nthreads;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&t->thread[i], NULL, triWorker, t) != 0)
+			break;
+	t->nthreads = i;
+	//without threads there is no index, every chunk is searched
+	if (i < nthreads)
+		__atomic_sub_fetch(&t->running, nthreads - i, __ATOMIC_ACQ_REL);
+}
+
+
+//stop building the index, the chunks already done are still used
+void triStop() {
+	struct triindex *t = E.tri;
+	int i;
+
+	if (t == NULL)
+		return;
+	__atomic_store_n(&t->cancel, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < t->nthreads; i++)
+		pthread_join(t->thread[i], NULL);
+	t->nthreads = 0;
+}
+
+
+//the trigrams of the first TRI_SPAN bytes of a query, which the index
+//has for every chunk a match may start in
+void triQuery(struct triquery *tq, const char *s, size_t len) {
+	uint32_t v = 0;
+	size_t i;
+
+	tq->n = 0;
+	if (len > TRI_SPAN)
+		len = TRI_SPAN;
+	for (i = 0; i < len; i++) {
+		v = (v << 8 | triLower(s[i])) & 0xffffff;
+		if (i >= 2)
+			tq->bit[tq->n++] = triHash(v);
+	}
+}
+
+
+//can a match of the query start in chunk k
+int triMay(struct triindex *t, size_t k, struct triquery *tq) {
+	const uint64_t *w = t->bits + k * TRI_WORDS;
+	int i;
+
+	if (!__atomic_load_n(&t->ready[k], __ATOMIC_ACQUIRE))
+		return 1;
+	for (i = 0; i < tq->n; i++)
+		if (!(w[tq->bit[i] >> 6] & 1ull << (tq->bit[i] & 63)))
+			return 0;
+	return 1;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* search *******************************/
+
+//a query prepared for findMatch
+struct findq {
+	const char *s;
+	size_t len;
+	struct regex *re;       //the query compiled, for a regex search
+	struct findq *lit;      //text its matches contain, looked for first
+	int nocase;             //ascii letters match in either case
+	int word;               //only matches that are whole words count
+	unsigned char first;    //first and last byte, lowered with nocase
+	unsigned char last;
+	unsigned char ffold;    //0x20 to lower the bytes compared against
+	unsigned char lfold;    //first and last, 0 where case matters
+	struct triquery tri;    //trigrams every match starts with, for the index
+};
+
+
+//returns -1 for a regex that doesn't compile
+int findPrepare(struct findq *q, const char *s, int nocase, int word, int regex) {
+	q->s = s;
+	q->len = strlen(s);
+	q->nocase = nocase;
+	q->word = word;
+	q->first = s[0];
+	q->last = q->len ? s[q->len - 1] : 0;
+	q->ffold = nocase && isalpha(q->first) ? 0x20 : 0;
+	q->lfold = nocase && isalpha(q->last) ? 0x20 : 0;
+	q->first |= q->ffold;
+	q->last |= q->lfold;
+	q->re = NULL;
+	q->lit = NULL;
+	if (!regex) {
+		triQuery(&q->tri, s, q->len);
+		return 0;
+	}
+	q->tri.n = 0;
+	if ((q->re = reCompile(s, nocase)) == NULL)
+		return -1;
+	if (q->re->lit && (q->lit = memAlloc(MEM_SEARCH, sizeof(struct findq))) != NULL) {
+		findPrepare(q->lit, q->re->lit, nocase, 0, 0);
+		//not where a match starts, but somewhere on its line
+		q->tri = q->lit->tri;
+	}
+	return 0;
+}
+
+
+void findRelease(struct findq *q) {
+	reFree(q->re);
+	memFree(MEM_SEARCH, q->lit);
+	q->re = NULL;
+	q->lit = NULL;
+}
+
+
+int findWordChar(unsigned char c) {
+	return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+
+//does the query match at 'p', with hay[0..len) around it for the
+//whole word check
+int findVerify(struct findq *q, const char *hay, size_t len, const char *p) {
+	size_t j;
+	if (q->nocase) {
+		for (j = 0; j < q->len; j++)
+			if (tolower((unsigned char)p[j]) != tolower((unsigned char)q->s[j]))
+				return 0;
+	} else if (memcmp(p, q->s, q->len) != 0) {
+		return 0;
+	}
+	if (q->word) {
+		if (p > hay && findWordChar(p[-1]))
+			return 0;
+		if (p + q->len < hay + len && findWordChar(p[q->len]))
+			return 0;
+	}
+	return 1;
+}
+
+
+//plain fallback, also used for the tail the vector loops leave behind
+const char *findScalar(struct findq *q, const char *hay, size_t from, size_t len) {
+	const char *p = hay + from;
+	const char *end = hay + len - q->len;
+
+	for (; p <= end; p++) {
+		if (!q->ffold) {
+			p = memchr(p, q->first, end - p + 1);
+			if (p == NULL)
+				return NULL;
+		} else if (((unsigned char)*p | q->ffold) != q->first) {
+			continue;
+		}
+		if (findVerify(q, hay, len, p))
+			return p;
+	}
+	return NULL;
+}
+
+#ifdef SCRIB_X86
+//compare 16 positions at a time against the first and the last byte of
+//the query, only where both agree is the whole query compared
+const char *findSSE2(struct findq *q, const char *hay, size_t from, size_t len) {
+	const __m128i first = _mm_set1_epi8(q->first);
+	const __m128i last = _mm_set1_epi8(q->last);
+	const __m128i ffold = _mm_set1_epi8(q->ffold);
+	const __m128i lfold = _mm_set1_epi8(q->lfold);
+	size_t k = q->len - 1;
+	size_t i;
+	for (i = from; i + k + 16 <= len; i += 16) {
+		__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)), ffold);
+		__m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i + k)), lfold);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+														_mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			const char *p = hay + i + __builtin_ctz(mask);
+			if (findVerify(q, hay, len, p))
+				return p;
+			mask &= mask - 1;
+		}
+	}
+	return findScalar(q, hay, i, len);
+}
+
+//same as above, 32 positions at a time on cpus that have avx2
+__attribute__((target("avx2")))
+const char *findAVX2(struct findq *q, const char *hay, size_t from, size_t len) {
+	const __m256i first = _mm256_set1_epi8(q->first);
+	const __m256i last = _mm256_set1_epi8(q->last);
+	const __m256i ffold = _mm256_set1_epi8(q->ffold);
+	const __m256i lfold = _mm256_set1_epi8(q->lfold);
+	size_t k = q->len - 1;
+	size_t i;
+	for (i = from; i + k + 32 <= len; i += 32) {
+		__m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i)), ffold);
+		__m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i + k)), lfold);
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+															  _mm256_cmpeq_epi8(b, last)));
+		while (mask) {
+			const char *p = hay + i + __builtin_ctz(mask);
+			if (findVerify(q, hay, len, p))
+				return p;
+			mask &= mask - 1;
+		}
+	}
+	return findScalar(q, hay, i, len);
+}
+#endif
+
+//first match of the query in hay[0..len) starting at 'from' or later
+const char *findMem(struct findq *q, const char *hay, size_t from, size_t len) {
+	if (q->len == 0 || from > len || len - from < q->len)
+		return NULL;
+
+	//long queries rarely pass the filter by chance, while a repetitive
+	//one can make it verify at every byte. memmem is Two-Way then
+	if (q->len >= FIND_LONG && !q->nocase) {
+		const char *p = hay + from;
+		while ((p = memmem(p, hay + len - p, q->s, q->len)) != NULL) {
+			if (findVerify(q, hay, len, p))
+				return p;
+			p++;
+		}
+		return NULL;
+	}
+#ifdef SCRIB_X86
+	static int avx2 = -1;
+	if (avx2 == -1)
+		avx2 = __builtin_cpu_supports("avx2");
+	if (avx2)
+		return findAVX2(q, hay, from, len);
+	return findSSE2(q, hay, from, len);
+#else
+	return findScalar(q, hay, from, len);
+#endif
+}
+
+
+//first match of a regex in hay[0..len) starting at 'from' or later.
+//matches don't span lines. a forward scan finds the first line with
+//one, or a line with the text every match contains, and the line is
+//then read backwards to find where its first match starts
+const char *findRegex(struct findq *q, const char *hay, size_t from, size_t len) {
+	size_t at = from;
+
+	//the '\n' of a "\r\n" is no place on a line
+	if (at > 0 && at < len && hay[at] == '\n' && hay[at - 1] == '\r')
+		at++;
+	while (at <= len) {
+		size_t start = at, end, stop;
+		const char *nl;
+		if (q->lit) {
+			const char *p = findMem(q->lit, hay, at, len);
+			if (p == NULL)
+				return NULL;
+			nl = memrchr(hay + at, '\n', p - (hay + at));
+			if (nl)
+				start = nl - hay + 1;
+		} else {
+			long ls = reScan(q->re, hay, at, len);
+			if (ls < 0)
+				return NULL;
+			start = ls;
+		}
+		nl = memchr(hay + start, '\n', len - start);
+		end = stop = nl ? (size_t)(nl - hay) : len;
+		if (nl && stop > start && hay[stop - 1] == '\r')
+			stop--;
+		long s = reFirst(q->re, hay + start, stop - start, start == 0 || hay[start - 1] == '\n');
+		if (s >= 0)
+			return hay + start + s;
+		at = end + 1;
+	}
+	return NULL;
+}
+
+
+const char *findText(struct findq *q, const char *hay, size_t from, size_t len) {
+	return q->re ? findRegex(q, hay, from, len) : findMem(q, hay, from, len);
+}
+
+
+//first match in hay[from..len). in the mapped file the trigram index
+//is asked about each chunk first, those it rules out aren't read
+const char *findMatch(struct findq *q, const char *hay, size_t from, size_t len) {
+	struct triindex *t = E.tri;
+	size_t at = from, base, hi, stop;
+	int skipped = 0;
+
+	if (t == NULL || q->tri.n == 0 || from > len || len - from < TRI_CHUNK ||
+		hay < E.map || hay + len > E.map + E.maplen)
+		return findText(q, hay, from, len);
+	base = hay - E.map;
+	for (;;) {
+		size_t k = (base + at) / TRI_CHUNK;
+		if (at < len && !triMay(t, k, &q->tri)) {
+			at = (k + 1) * TRI_CHUNK - base;
+			skipped = 1;
+			continue;
+		}
+		if (at >= len)
+			return NULL;
+		//a regex match starts somewhere on the line with its text
+		if (skipped && q->re) {
+			const char *nl = memrchr(hay + from, '\n', at - from);
+			at = nl ? (size_t)(nl - hay) + 1 : from;
+		}
+		skipped = 0;
+		hi = (k + 1) * TRI_CHUNK - base;
+		if (hi >= len)
+			return findText(q, hay, at, len);
+
+		//matches starting in the chunk may run on past it, a plain one by
+		//its length and the byte after for the whole word check
+		if (q->re) {
+			const char *nl = memchr(hay + hi, '\n', len - hi);
+			stop = nl ? (size_t)(nl - hay) + 1 : len;
+		} else {
+			stop = len - hi > q->len ? hi + q->len : len;
+		}
+		const char *p = findText(q, hay, at, stop);
+		if (p && (q->re || p < hay + hi))
+			return p;
+		at = q->re ? stop : hi;
+	}
+}
+
+
+//how far past a match at 'p' the next one may start. plain matches
+//may overlap, a regex takes the longest match and goes on after it
+size_t findSkip(struct findq *q, const char *hay, size_t len, const char *p) {
+	if (q->re == NULL)
+		return 1;
+	const char *nl = memchr(p, '\n', hay + len - p);
+	const char *stop = nl ? nl : hay + len;
+	if (nl && stop > p && stop[-1] == '\r')
+		stop--;
+	size_t n = reLongest(q->re, p, stop - p, p == hay || p[-1] == '\n');
+	return n ? n : 1;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+/************************* find ****************************/
+
+//does mapped row 'r' start right after the line ending at 'end'
+int findFollows(const char *end, erow *r) {
+	if (!(r->flags & ROW_MAPPED) || r->chars <= end || r->chars - end > 2)
+		return 0;
+	return r->chars[-1] == '\n' && (r->chars - end == 1 || end[0] == '\r');
+}
+
+
+//the stretch of rows from 'at' towards 'end' (not included) whose text
+//lies back to back in the mapped file, so it can be searched in one go.
+//'dir' says which way it grows. sets the rows [*lo, *hi] it spans and
+//returns the text, *len bytes of it
+const char *findRun(int at, int end, int dir, int *lo, int *hi, size_t *len) {
+	erow *row = editorRowAt(at);
+	const char *start = editorRowText(row);
+	const char *stop = start + row->size;
+	size_t bytes;
+	int clean = editorCleanRows(&bytes);
+	int idx;
+
+	*lo = *hi = at;
+	if (at < clean) {	//the untouched start of the file is all one run
+		if (dir > 0) {
+			*hi = end <= clean ? end - 1 : clean - 1;
+			row = editorRowAt(*hi);
+			stop = row->chars + row->size;
+		} else {
+			*lo = end + 1;
+			start = editorRowAt(*lo)->chars;
+		}
+	} else if ((row->flags & ROW_MAPPED) && dir > 0) {
+		while (*hi + 1 < end) {
+			struct rowleaf *lf = rtFind(E.rows, *hi + 1, &idx);
+			for (; idx < lf->h.n && *hi + 1 < end; idx++) {
+				if (!findFollows(stop, &lf->row[idx]))
+					goto done;
+				stop = lf->row[idx].chars + lf->row[idx].size;
+				(*hi)++;
+			}
+		}
+	} else if (row->flags & ROW_MAPPED) {
+		//stops short of the clean rows, they are the next run
+		while (*lo - 1 > end && *lo - 1 >= clean) {
+			struct rowleaf *lf = rtFind(E.rows, *lo - 1, &idx);
+			for (; idx >= 0 && *lo - 1 > end && *lo - 1 >= clean; idx--) {
+				erow *prev = &lf->row[idx];
+				if (!(prev->flags & ROW_MAPPED) ||
+					!findFollows(prev->chars + prev->size, row))
+					goto done;
+				row = prev;
+				start = prev->chars;
+				(*lo)--;
+			}
+		}
+	}
+done:
+	*len = stop - start;
+	return start;
+}
+
+
+//the row of a run [lo, hi] that text at 'p' belongs to
+int findRowOf(int lo, int hi, const char *p) {
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (editorRowAt(mid)->chars <= p)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+
+//first match in rows [y, end), at column x or later in row y
+int findForward(struct findq *q, int y, int x, int end, int *my, int *mx) {
+	while (y < end) {
+		int lo, hi;
+		size_t len;
+		erow *row = editorRowAt(y);
+		if (x > row->size) {	//past a match at the end of the row
+			y++;
+			x = 0;
+			continue;
+		}
+		const char *run = findRun(y, end, 1, &lo, &hi, &len);
+		size_t from = editorRowText(row) - run + x;
+		const char *p = findMatch(q, run, from, len);
+		if (p) {
+			*my = findRowOf(lo, hi, p);
+			*mx = p - editorRowText(editorRowAt(*my));
+			return 1;
+		}
+		y = hi + 1;
+		x = 0;
+	}
+	return 0;
+}
+
+
+//last match in rows (end, y], before column x in row y
+int findBackward(struct findq *q, int y, int x, int end, int *my, int *mx) {
+	while (y > end) {
+		int lo, hi;
+		size_t len;
+		const char *run = findRun(y, end, -1, &lo, &hi, &len);
+		erow *row = editorRowAt(y);
+		//past the end of the row a regex may still match where it ends
+		const char *limit = editorRowText(row) + (x <= row->size ? x : row->size + 1);
+		const char *p, *last = NULL;
+		size_t from = 0;
+		while ((p = findMatch(q, run, from, len)) != NULL && p < limit) {
+			last = p;
+			from = p - run + findSkip(q, run, len, p);
+		}
+		if (last) {
+			*my = findRowOf(lo, hi, last);
+			*mx = last - editorRowText(editorRowAt(*my));
+			return 1;
+		}
+		y = lo - 1;
+		x = INT_MAX;
+	}
+	return 0;
+}
+
+
+//a match, as row and column
+struct findpos {
+	int y, x;
+};
+
+//rows [lo, hi) of a search for every match, see findStart
+struct findtask {
+	int lo, hi;
+	struct findpos *pos;    //its matches in order, while the index has room
+	int npos, cap;
+	long long count;        //all of its matches
+};
+
+//a search for every match of a query, run by a pool of threads that
+//each take the next task until none are left. the tasks go through the
+//file in order, so putting their matches one after the other gives a
+//sorted index of them
+struct findjob {
+	struct findq q;
+	char *query;
+	struct findtask *task;
+	int ntasks;
+	int next;               //first task no thread has taken yet
+	int cancel;             //set to make the threads give up
+	int running;            //threads that haven't finished
+	int nthreads;
+	pthread_t thread[SCAN_MAX_THREADS];
+	long long room;         //index entries handed out to the tasks
+	int full;               //there were more than FIND_MAX_INDEX of them
+	int done;               //the threads were joined by findCollect
+	long long count;        //matches in the file
+	struct findpos *index;  //all of them in order, NULL if too many
+};
+
+
+void findTaskAdd(struct findjob *job, struct findtask *t, int y, int x) {
+	t->count++;
+	if (t->npos == t->cap) {
+		//room is taken from the shared limit a chunk at a time
+		int grow = t->cap ? t->cap : 256;
+		struct findpos *pos = NULL;
+		if (!__atomic_load_n(&job->full, __ATOMIC_RELAXED) &&
+			__atomic_add_fetch(&job->room, grow, __ATOMIC_RELAXED) <= FIND_MAX_INDEX)
+			pos = memRealloc(MEM_SEARCH, t->pos, (t->cap + grow) * sizeof(struct findpos));
+		if (pos == NULL) {
+			__atomic_store_n(&job->full, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		t->pos = pos;
+		t->cap += grow;
+	}
+	t->pos[t->npos].y = y;
+	t->pos[t->npos].x = x;
+	t->npos++;
+}
+
 
-	//make number of changes to 0 on opening
-	E.dirty = 0;
+//every match in the task's rows, found a run at a time like findForward
+void findTaskRun(struct findjob *job, struct findq *q, struct findtask *t) {
+	int y = t->lo;
+	while (y < t->hi) {
+		int lo, hi, idx;
+		size_t len, from = 0;
+		const char *run = findRun(y, t->hi, 1, &lo, &hi, &len);
+		const char *p;
+		struct rowleaf *lf = rtFind(E.rows, lo, &idx);
+		int r = lo;
+		while ((p = findMatch(q, run, from, len)) != NULL) {
+			//matches come in order, the row they are in only moves on
+			while (r < hi) {
+				struct rowleaf *nl = lf;
+				int ni = idx + 1;
+				if (ni == lf->h.n)
+					nl = rtFind(E.rows, r + 1, &ni);
+				if (nl->row[ni].chars > p)
+					break;
+				lf = nl;
+				idx = ni;
+				r++;
+			}
+			findTaskAdd(job, t, r, p - editorRowText(&lf->row[idx]));
+			from = p - run + findSkip(q, run, len, p);
+		}
+		y = hi + 1;
+	}
 }
 
 
+//thread of a search, the last one to finish signals E.findfd
+void *findWorker(void *arg) {
+	struct findjob *job = arg;
+	struct findq q;
+	int t;
+
+	//a regex builds its dfa as it goes, so each thread needs its own
+	if (findPrepare(&q, job->query, job->q.nocase, job->q.word, job->q.re != NULL) == -1)
+		__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+	while (!__atomic_load_n(&job->cancel, __ATOMIC_RELAXED) &&
+		   (t = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->ntasks)
+		findTaskRun(job, &q, &job->task[t]);
+	findRelease(&q);
+	if (__atomic_sub_fetch(&job->running, 1, __ATOMIC_ACQ_REL) == 0) {
+		uint64_t one = 1;
+		write(E.findfd, &one, sizeof(one));
+	}
+	return NULL;
+}
 
 
-//write contents of editor into file and save
-void editorSave() {
+//count and index every match of the query in the background. the rows
+//must all be indexed and stay as they are until findStop, which the row
+//primitives call before changing them. the matches outlive the prompt
+void findStart(const char *query) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = ncpu > 0 ? (ncpu > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : ncpu) : 1;
+	struct findjob *job;
+	int i;
+
+	findStop();
+	if (E.numrows == 0 || query[0] == '\0')
+		return;
+	job = memCalloc(MEM_SEARCH, 1, sizeof(struct findjob));
+	if (job == NULL || (job->query = strdup(query)) == NULL) {
+		memFree(MEM_SEARCH, job);
+		return;
+	}
+	if (findPrepare(&job->q, job->query, E.findnocase, E.findword, E.findregex) == -1) {
+		free(job->query);
+		memFree(MEM_SEARCH, job);
+		return;
+	}
+	job->ntasks = (E.numrows + FIND_TASK_ROWS - 1) / FIND_TASK_ROWS;
+	job->task = memCalloc(MEM_SEARCH, job->ntasks, sizeof(struct findtask));
+	if (job->task == NULL) {
+		findRelease(&job->q);
+		free(job->query);
+		memFree(MEM_SEARCH, job);
+		return;
+	}
+	for (i = 0; i < job->ntasks; i++) {
+		job->task[i].lo = i * FIND_TASK_ROWS;
+		job->task[i].hi = i == job->ntasks - 1 ? E.numrows : (i + 1) * FIND_TASK_ROWS;
+	}
+	if (nthreads > job->ntasks)
+		nthreads = job->ntasks;
 
-	//if its a new file, prompt for a name from user
-  	if (E.filename == NULL) {
-  		//if user enters filename and presses enter, save file
-    	E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    	//if no name is returned, i.e. user pressed esc, abort save
-    	if (E.filename == NULL) {
-      		editorSetStatusMessage("Save aborted");
-      	return;
-    }
-  	}  
+	E.find = job;
+	job->running = nthreads;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&job->thread[i], NULL, findWorker, job) != 0)
+			break;
+	job->nthreads = i;
+	if (i == 0) {	//no threads to be had, search right here
+		job->running = 1;
+		findWorker(job);
+	} else if (i < nthreads && __atomic_sub_fetch(&job->running, nthreads - i,
+												 __ATOMIC_ACQ_REL) == 0) {
+		uint64_t one = 1;	//those that did start are already done
+		write(E.findfd, &one, sizeof(one));
+	}
+}
 
-  	int len;
-  	//get content of editor into buf
-  	char *buf = editorRowsToString(&len);
-  	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  	ftruncate(fd, len);
-
-  	//write the contents of editor i.e. buf into file and save
-  	write(fd, buf, len);
-  	if (fd != -1) {	//if no error occured while opening file
-    	if (ftruncate(fd, len) != -1) {	//if no error occured while truncating
-      		if (write(fd, buf, len) == len) {	//if no error occured while writing	
-  				close(fd);
-  				free(buf);
-
-  				//make number of changes to 0 on saving file to disk
-  				E.dirty = 0;
-
-  				//display successful save status in status bar
-  				editorSetStatusMessage("%d bytes written to disk", len);
-  				return;
-  			}
-  		}
-  		close(fd);
-  	}
 
-  	free(buf);
-  	//display unsuccessful save msg in status bar
-  	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+//wait for the threads of the search and take its wake-up
+void findJoin(struct findjob *job) {
+	uint64_t count;
+	int i;
+	for (i = 0; i < job->nthreads; i++)
+		pthread_join(job->thread[i], NULL);
+	job->nthreads = 0;
+	if (read(E.findfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		die("read");
+}
+
 
+//the search is done, put the index together from its tasks
+void findCollect() {
+	struct findjob *job = E.find;
+	long long n = 0;
+	int i;
+
+	if (job == NULL || job->done)
+		return;
+	findJoin(job);
+	job->done = 1;
+	for (i = 0; i < job->ntasks; i++)
+		job->count += job->task[i].count;
+	if (!job->full)
+		job->index = memAlloc(MEM_SEARCH, (job->count ? job->count : 1) * sizeof(struct findpos));
+	for (i = 0; i < job->ntasks; i++) {
+		if (job->index && job->task[i].npos) {
+			memcpy(job->index + n, job->task[i].pos, job->task[i].npos * sizeof(struct findpos));
+			n += job->task[i].npos;
+		}
+		memFree(MEM_SEARCH, job->task[i].pos);
+		job->task[i].pos = NULL;
+	}
 }
 
 
+//cancel the search, if it is still running, and forget it
+void findStop() {
+	struct findjob *job = E.find;
+	int i;
+
+	if (job == NULL)
+		return;
+	if (!job->done) {
+		__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+		findJoin(job);
+		for (i = 0; i < job->ntasks; i++)
+			memFree(MEM_SEARCH, job->task[i].pos);
+	}
+	findRelease(&job->q);
+	memFree(MEM_SEARCH, job->task);
+	memFree(MEM_SEARCH, job->index);
+	free(job->query);
+	memFree(MEM_SEARCH, job);
+	E.find = NULL;
+}
 
 
+//stop a search that is still running, one that is done keeps its matches
+void findCancel() {
+	if (E.find && !E.find->done)
+		findStop();
+}
+
 
+//entries of the index before row y column x
+long long findIndexBefore(struct findjob *job, int y, int x) {
+	long long lo = 0, hi = job->count;
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+		struct findpos *m = &job->index[mid];
+		if (m->y < y || (m->y == y && m->x < x))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
 
+//the match after row y column x in the index, or before it for dir -1,
+//wrapping around the file
+int findIndexStep(struct findjob *job, int y, int x, int dir, int *my, int *mx) {
+	long long i;
+	if (job->count == 0)
+		return 0;
+	if (dir > 0) {
+		i = findIndexBefore(job, y, x + 1);
+		if (i == job->count)
+			i = 0;
+	} else {
+		i = findIndexBefore(job, y, x) - 1;
+		if (i < 0)
+			i = job->count - 1;
+	}
+	*my = job->index[i].y;
+	*mx = job->index[i].x;
+	return 1;
+}
 
 
+//the prompt tells which options are on, it is rewritten as they change.
+//whole words are for plain text, a regex can say where words end itself
+char findPrompt[128];
 
-/************************* find ****************************/
+void findSetPrompt(int bad) {
+	snprintf(findPrompt, sizeof(findPrompt),
+			 "Search%s%s%s: %%s (ESC/Arrows/Enter ^C case ^W word ^R regex)",
+			 E.findnocase ? " [any case]" : "", E.findword && !E.findregex ? " [word]" : "",
+			 E.findregex ? (bad ? " [bad regex]" : " [regex]") : "");
+}
 
 
 //Find 
@@ -580,42 +5104,121 @@ void editorFindCallback(char *query, int key) {
 
 	//enable user to got to next or previous match using arow keys
   	static int last_match = -1;
+  	static int last_col = 0;
   	static int direction = 1;
-  	if (key == '\r' || key == '\x1b') {
+  	//the query last_match was found for, and whether it is the first
+  	//match of it in the file. a query that matched nowhere has -1
+  	static char *last_query = NULL;
+  	static int last_first = 0;
+  	int narrow = 0;
+
+  	if (key == '\r' || key == '\x1b') {	//the count stays up until an edit
   	  	last_match = -1;
   	  	direction = 1;
+  	  	free(last_query);
+  	  	last_query = NULL;
   	  	return;
   	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
   	  	direction = 1;
   	} else if (key == ARROW_LEFT || key == ARROW_UP) {
   	  	direction = -1;
   	} else {
-  	  	last_match = -1;
+  	  	if (key == CTRL_KEY('c'))
+  	  		E.findnocase = !E.findnocase;
+  	  	else if (key == CTRL_KEY('w'))
+  	  		E.findword = !E.findword;
+  	  	else if (key == CTRL_KEY('r'))
+  	  		E.findregex = !E.findregex;
+  	  	findSetPrompt(0);
+
+  	  	//a query that grew only matches where the shorter one did, so
+  	  	//the search narrows down from the last match instead of starting
+  	  	//over. not for whole words, "foo" ending a word says nothing
+  	  	//about "foob" there, nor for a regex, "a|b" grew from "a"
+  	  	size_t len = last_query ? strlen(last_query) : 0;
+  	  	narrow = len > 0 && !E.findword && !E.findregex && key != CTRL_KEY('c') &&
+  	  			 key != CTRL_KEY('w') && key != CTRL_KEY('r') && strlen(query) > len &&
+  	  			 strncmp(query, last_query, len) == 0;
+  	  	if (!narrow)
+  	  		last_match = -1;
   	  	direction = 1;
   	}
 
   	if (last_match == -1) direction = 1;
-  	int current = last_match;
-
-  	int i;
-  	for (i = 0; i < E.numrows; i++) {
-
-  	  	current += direction;
-    	if (current == -1) current = E.numrows - 1;
-    	else if (current == E.numrows) current = 0;
-    	erow *row = &E.row[current];
-
-    	//search
-  	  	char *match = strstr(row->render, query);
-  	  	if (match) {
-  	  		last_match = current;
-      		E.cy = current;
-  	  	  	E.cx = editorRowRxToCx(row, match - row->render);
-  	  	  	E.rowoff = E.numrows;
-  	  	  	break;
-  	  	}
+
+  	//a replay sends its keys all at once. someone stepping through the
+  	//matches would have had them counted by then
+  	if (E.replay && last_match != -1 && (key == ARROW_RIGHT || key == ARROW_DOWN ||
+  		key == ARROW_LEFT || key == ARROW_UP))
+  		findCollect();
+
+  	//every row has to be known before wrapping around the file
+  	editorIndexRows(INT_MAX);
+  	editorRowCloseGap();
+  	if (E.numrows == 0)
+  		return;
+  	struct findq q;
+  	free(last_query);
+  	last_query = strdup(query);
+  	if (findPrepare(&q, query, E.findnocase, E.findword, E.findregex) == -1) {
+  		findSetPrompt(1);
+  		last_match = -1;
+  		findStop();
+  		return;
+  	}
+
+  	//look from the last match on, then wrap around the end of the file
+  	int y, x, found;
+  	if (narrow && last_match == -1) {	//the shorter query didn't match either
+  		found = 0;
+  	} else if (narrow) {
+  		erow *row = editorRowAt(last_match);
+  		y = last_match;
+  		x = last_col;
+  		//nothing before the first match can match now, no need to wrap
+  		found = (last_col + q.len <= (size_t)row->size &&
+  				 findVerify(&q, editorRowText(row), row->size, editorRowText(row) + last_col)) ||
+  				findForward(&q, last_match, last_col + 1, E.numrows, &y, &x) ||
+  				(!last_first && findForward(&q, 0, 0, last_match + 1, &y, &x));
+  		last_first = last_first && found && (y > last_match ||
+  					 (y == last_match && x >= last_col));
+  	} else if (last_match == -1) {
+  		found = findForward(&q, 0, 0, E.numrows, &y, &x);
+  		last_first = 1;
+  	} else if (E.find && E.find->index) {	//every match is known already
+  		found = findIndexStep(E.find, last_match, last_col, direction, &y, &x);
+  		last_first = 0;
+  	} else if (direction == 1) {
+  		erow *row = editorRowAt(last_match);
+  		const char *text = editorRowText(row);
+  		size_t skip = findSkip(&q, text, row->size, text + last_col);
+  		found = findForward(&q, last_match, last_col + skip, E.numrows, &y, &x) ||
+  				findForward(&q, 0, 0, last_match + 1, &y, &x);
+  		last_first = 0;
+  	} else {
+  		found = findBackward(&q, last_match, last_col, -1, &y, &x) ||
+  				findBackward(&q, E.numrows - 1, INT_MAX, last_match - 1, &y, &x);
+  		last_first = 0;
+  	}
+
+  	if (found) {
+  		last_match = y;
+  		last_col = x;
+  		E.cy = y;
+  		E.cx = x;
+  		E.rowoff = E.numrows;
+  	} else if (narrow || last_match == -1) {
+  		last_match = -1;
   	}
 
+  	//then count the matches of a new query in the background
+  	if (!found)
+  		findStop();
+  	else if (E.find == NULL || strcmp(E.find->query, query) != 0 ||
+  			 E.find->q.nocase != E.findnocase || E.find->q.word != E.findword ||
+  			 (E.find->q.re != NULL) != E.findregex)
+  		findStart(query);
+  	findRelease(&q);
 }
 
 
@@ -627,8 +5230,8 @@ void editorFind() {
   	int saved_coloff = E.coloff;
   	int saved_rowoff = E.rowoff;
 
-  	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
+  	findSetPrompt(0);
+  	char *query = editorPrompt(findPrompt, editorFindCallback);
   	if (query){
   		free(query);
   	} else {
@@ -663,16 +5266,259 @@ struct abuf {
 
 //append operation on string
 void abAppend(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
+	//realloc to 0 bytes would free a buffer that is being reused
+	if (len == 0)
+		return;
+	char *new = memRealloc(MEM_FRAME, ab->b, ab->len + len);
 	if (new == NULL) return;
 	memcpy(&new[ab->len], s, len);
 	ab->b = new;
 	ab->len += len;
 }
 void abFree(struct abuf *ab) {
-	free(ab->b);
+	memFree(MEM_FRAME, ab->b);
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/*********************** frame buffer *************************/
+
+//(re)allocate a frame for a screen of the given size, blanking it
+void frameResize(struct frame *f, int rows, int cols) {
+	if (f->rows == rows && f->cols == cols)
+		return;
+	memFree(MEM_FRAME, f->chars);
+	memFree(MEM_FRAME, f->attrs);
+	f->rows = rows;
+	f->cols = cols;
+	f->chars = memAlloc(MEM_FRAME, rows * cols);
+	f->attrs = memAlloc(MEM_FRAME, rows * cols);
+	if (f->chars == NULL || f->attrs == NULL) die("malloc");
+	memset(f->chars, ' ', rows * cols);
+	memset(f->attrs, 0, rows * cols);
+}
+
+//forget what the terminal shows so the next flush repaints everything
+void frameInvalidate(struct frame *f) {
+	memFree(MEM_FRAME, f->chars);
+	memFree(MEM_FRAME, f->attrs);
+	f->chars = NULL;
+	f->attrs = NULL;
+	f->rows = 0;
+	f->cols = 0;
+}
+
+//fill screen line 'y' with s[0..len) followed by blanks
+void frameSetRow(struct frame *f, int y, const char *s, int len, int attr) {
+	if (y < 0 || y >= f->rows)
+		return;
+	if (len > f->cols)
+		len = f->cols;
+	if (len < 0)
+		len = 0;
+	char *c = &f->chars[y * f->cols];
+	if (len > 0)	//an empty line can come with no text at all
+		memcpy(c, s, len);
+	memset(c + len, ' ', f->cols - len);
+	memset(&f->attrs[y * f->cols], attr, f->cols);
+}
+
+//move lines top..bottom-1 of a frame up by 'delta' lines (down if negative),
+//blanking the lines that are exposed, like the terminal does when scrolling
+void frameScroll(struct frame *f, int top, int bottom, int delta) {
+	int n = bottom - top - (delta > 0 ? delta : -delta);
+	int cols = f->cols;
+	if (delta > 0) {
+		memmove(&f->chars[top * cols], &f->chars[(top + delta) * cols], n * cols);
+		memmove(&f->attrs[top * cols], &f->attrs[(top + delta) * cols], n * cols);
+		memset(&f->chars[(top + n) * cols], ' ', delta * cols);
+		memset(&f->attrs[(top + n) * cols], 0, delta * cols);
+	} else {
+		memmove(&f->chars[(top - delta) * cols], &f->chars[top * cols], n * cols);
+		memmove(&f->attrs[(top - delta) * cols], &f->attrs[top * cols], n * cols);
+		memset(&f->chars[top * cols], ' ', -delta * cols);
+		memset(&f->attrs[top * cols], 0, -delta * cols);
+	}
+}
+
+//number of lines in top..bottom-1 of 'f' equal to the line 'delta' further
+//down in 's', used to tell whether the screen just scrolled
+int frameMatches(struct frame *f, struct frame *s, int top, int bottom, int delta) {
+	int y, matches = 0;
+	for (y = top; y < bottom; y++) {
+		int sy = y + delta;
+		if (sy < top || sy >= bottom)
+			continue;
+		if (memcmp(&f->chars[y * f->cols], &s->chars[sy * f->cols], f->cols) == 0 &&
+			memcmp(&f->attrs[y * f->cols], &s->attrs[sy * f->cols], f->cols) == 0)
+			matches++;
+	}
+	return matches;
+}
+
+//move the terminal cursor to screen cell y,x (0 based)
+void frameMoveTo(struct abuf *ab, int y, int x) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+	abAppend(ab, buf, len);
+}
+
+//switch the terminal to the attributes of a cell
+void frameSetAttr(struct abuf *ab, int attr) {
+	if (attr & FRAME_INVERSE)
+		abAppend(ab, "\x1b[7m", 4);
+	else
+		abAppend(ab, "\x1b[m", 3);
 }
 
+//send the cells of E.frame that differ from what the terminal shows,
+//leave the cursor at y,x and make E.frame the new shadow copy.
+//the first 'textrows' lines hold the file, when they only moved vertically
+//the terminal is told to scroll them so just the exposed lines are drawn
+void editorFlushFrame(int textrows, int cury, int curx) {
+	struct frame *f = &E.frame;
+	struct frame *s = &E.shadow;
+	struct abuf ab = ABUF_INIT;
+	int attr = 0;	//attributes are always reset at the end of a flush
+	int ty = -1, tx = -1;	//terminal cursor, -1 while unknown
+	int y, x;
+
+	if (s->rows != f->rows || s->cols != f->cols) {
+		frameResize(s, f->rows, f->cols);
+		abAppend(&ab, "\x1b[2J", 4);
+	} else {
+		int delta = f->rowoff - s->rowoff;
+		if (delta != 0 && delta < textrows && -delta < textrows &&
+			frameMatches(f, s, 0, textrows, delta) >
+			frameMatches(f, s, 0, textrows, 0) + 1) {
+			char buf[32];
+			//restrict scrolling to the text lines, scroll, lift the restriction
+			int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+							   textrows, delta > 0 ? delta : -delta,
+							   delta > 0 ? 'S' : 'T');
+			abAppend(&ab, buf, len);
+			frameScroll(s, 0, textrows, delta);
+		}
+	}
+
+	for (y = 0; y < f->rows; y++) {
+		char *nc = &f->chars[y * f->cols], *oc = &s->chars[y * f->cols];
+		unsigned char *na = &f->attrs[y * f->cols], *oa = &s->attrs[y * f->cols];
+		if (memcmp(nc, oc, f->cols) == 0 && memcmp(na, oa, f->cols) == 0)
+			continue;
+
+		//blank cells at the end of the new line can be cleared with EL
+		int tail = f->cols;
+		while (tail > 0 && nc[tail - 1] == ' ' && na[tail - 1] == 0)
+			tail--;
+
+		//column arithmetic only holds for single byte characters,
+		//lines with anything else are sent whole
+		int whole = 0;
+		for (x = 0; x < f->cols && !whole; x++)
+			if ((unsigned char)nc[x] >= 0x80 || (unsigned char)oc[x] >= 0x80)
+				whole = 1;
+
+		int end = f->cols - 1;
+		int clear = 0;
+		if (whole) {
+			end = tail - 1;
+			clear = tail < f->cols;
+		} else {
+			while (nc[end] == oc[end] && na[end] == oa[end])
+				end--;
+			if (end >= tail + FRAME_SPAN_GAP) {
+				end = tail - 1;
+				clear = 1;
+			}
+		}
+
+		//send runs of changed cells, short runs of unchanged ones in
+		//between are resent as that is cheaper than moving the cursor
+		for (x = 0; x <= end; ) {
+			if (!whole && nc[x] == oc[x] && na[x] == oa[x]) {
+				x++;
+				continue;
+			}
+			int a = x, b = x, same = 0;
+			for (x = a + 1; x <= end && same < FRAME_SPAN_GAP; x++) {
+				if (!whole && nc[x] == oc[x] && na[x] == oa[x]) {
+					same++;
+				} else {
+					b = x;
+					same = 0;
+				}
+			}
+			if (ty != y || tx != a)
+				frameMoveTo(&ab, y, a);
+			int i;
+			for (i = a; i <= b; ) {
+				int j = i;
+				if (na[i] != attr) {
+					attr = na[i];
+					frameSetAttr(&ab, attr);
+				}
+				while (j <= b && na[j] == attr)
+					j++;
+				abAppend(&ab, &nc[i], j - i);
+				i = j;
+			}
+			ty = y;
+			tx = b + 1;
+			x = b + 1;
+		}
+
+		if (clear) {
+			if (ty != y || tx != tail)
+				frameMoveTo(&ab, y, tail);
+			if (attr != 0) {
+				attr = 0;
+				frameSetAttr(&ab, attr);
+			}
+			abAppend(&ab, "\x1b[K", 3);
+			ty = y;
+			tx = tail;
+		}
+	}
+
+	if (attr != 0)
+		frameSetAttr(&ab, 0);
+
+	if (ab.len > 0 || s->cy != cury || s->cx != curx) {
+		struct abuf out = ABUF_INIT;
+		if (ab.len > 0)
+			abAppend(&out, "\x1b[?25l", 6);	//hide the cursor while drawing
+		abAppend(&out, ab.b, ab.len);
+		frameMoveTo(&out, cury, curx);
+		if (ab.len > 0)
+			abAppend(&out, "\x1b[?25h", 6);
+		editorWrite(out.b, out.len);
+		abFree(&out);
+	}
+	abFree(&ab);
+
+	//what was just drawn is now on screen, reuse the old shadow next time
+	char *chars = s->chars;
+	unsigned char *attrs = s->attrs;
+	s->chars = f->chars;
+	s->attrs = f->attrs;
+	f->chars = chars;
+	f->attrs = attrs;
+	s->cy = cury;
+	s->cx = curx;
+	s->rowoff = f->rowoff;
+}
 
 
 
@@ -691,21 +5537,40 @@ void abFree(struct abuf *ab) {
 //draw status bar
 void editorDrawStatusBar(struct abuf *ab) {
 
-	//escape sequence [7m switches to inverted color
-	abAppend(ab, "\x1b[7m", 4);
-
 	//display filename in status bar
 	char status[80], rstatus[80];
 
 	//display file info 
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    				E.filename ? E.filename : "[No Name]", E.numrows,
-    				E.dirty ? "(modified)" : "");
+	//a '+' after the line count while the file is still being indexed
+	const char *more = E.mapoff < E.maplen ? "+" : "";
+	char saving[24] = "";
+	if (E.save) {	//how far the save in progress has got
+		size_t total = __atomic_load_n(&E.save->total, __ATOMIC_RELAXED);
+		size_t done = __atomic_load_n(&E.save->done, __ATOMIC_RELAXED);
+		snprintf(saving, sizeof(saving), " (saving %d%%)",
+				 total ? (int)(done * 100 / total) : 0);
+	}
+	char found[56] = "";
+	if (E.find && !E.find->done) {
+		snprintf(found, sizeof(found), " (counting matches)");
+	} else if (E.find && E.find->index) {	//which of them the cursor is on
+		long long i = findIndexBefore(E.find, E.cy, E.cx);
+		if (i < E.find->count && E.find->index[i].y == E.cy && E.find->index[i].x == E.cx)
+			snprintf(found, sizeof(found), " (match %lld of %lld)", i + 1, E.find->count);
+		else
+			snprintf(found, sizeof(found), " (%lld matches)", E.find->count);
+	} else if (E.find) {
+		snprintf(found, sizeof(found), " (%lld matches)", E.find->count);
+	}
+	int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s%s%s",
+    				E.filename ? E.filename : "[No Name]", E.numrows, more,
+    				E.dirty ? "(modified)" : "", saving, found);
 
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-												E.cy + 1, E.numrows);
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d%s",
+												E.cy + 1, E.numrows, more);
 	if (len > E.screencols) 
 		len = E.screencols;
+	ab->len = 0;
 	abAppend(ab, status, len);
 
 	while (len < E.screencols) {
@@ -719,18 +5584,25 @@ void editorDrawStatusBar(struct abuf *ab) {
 			len++;
 		}
 	}
-	//escape sequence [7m switches back to normal color
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
+	//the status bar is drawn in inverted color
+	frameSetRow(&E.frame, E.screenrows, ab->b, ab->len, FRAME_INVERSE);
 }
 
 //message bar
 void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+  ab->len = 0;
+  if (E.prof.show) {
+	char buf[256];
+	int len = profOverlay(buf, sizeof(buf));
+	abAppend(ab, buf, len < E.screencols ? len : E.screencols);
+	frameSetRow(&E.frame, E.screenrows + 1, ab->b, ab->len, 0);
+	return;
+  }
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
+  if (msglen && time(NULL) - E.statusmsg_time < SCRIB_MSG_SECS)
 	abAppend(ab, E.statusmsg, msglen);
+  frameSetRow(&E.frame, E.screenrows + 1, ab->b, ab->len, 0);
 }
 
 
@@ -738,9 +5610,19 @@ void editorDrawMessageBar(struct abuf *ab) {
 //To enable scrolling when cursor moves out of window
 void editorScroll() {
 	
+	//make sure every row that is about to be drawn has been indexed
+	editorIndexRows(E.cy > E.rowoff + E.screenrows ? E.cy :
+						E.rowoff + E.screenrows);
+
 	E.rx = 0;
 	if (E.cy < E.numrows) {
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		erow *row = editorRowAt(E.cy);
+		//the line typed into is only compacted once the cursor leaves it
+		if (E.gaprow && E.gaprow != row)
+			editorRowCloseGap();
+		E.rx = editorRowCxToRx(row, E.cx);
+	} else {
+		editorRowCloseGap();
 	}
 
 
@@ -766,14 +5648,67 @@ void editorScroll() {
 
 
 
+//append characters 'from' to 'to' of a row, stepping over the gap
+void editorDrawChars(struct abuf *ab, erow *row, int from, int to) {
+	if (from >= to)
+		return;
+	const char *text = editorRowText(row);
+	if (!(row->flags & ROW_GAP) || to <= E.gap) {
+		abAppend(ab, &text[from], to - from);
+	} else if (from >= E.gap) {
+		abAppend(ab, &text[from + E.gaplen], to - from);
+	} else {
+		abAppend(ab, &text[from], E.gap - from);
+		abAppend(ab, &text[E.gap + E.gaplen], to - E.gap);
+	}
+}
+
+
+//draw the columns of a row that fit between coloff and the right edge of
+//the screen. tabs are expanded on the fly, so no rendered copy of a row is
+//kept and rows without tabs are drawn straight from their chars
+void editorDrawRow(struct abuf *ab, erow *row) {
+	int end = E.coloff + E.screencols;
+	int scan = row->size < end ? row->size : end;
+
+	//without a tab before the right edge every char is one column
+	if (!editorRowHasTab(row, scan)) {
+		editorDrawChars(ab, row, E.coloff, scan);
+		return;
+	}
+
+	char buf[256];
+	int len = 0;
+	int rx = 0;
+	int cx;
+	for (cx = 0; cx < row->size && rx < end; cx++) {
+		char c = editorRowChar(row, cx);
+		do {
+			if (rx >= E.coloff) {
+				buf[len++] = (c == '\t') ? ' ' : c;
+				if (len == sizeof(buf)) {
+					abAppend(ab, buf, len);
+					len = 0;
+				}
+			}
+			rx++;
+		} while (c == '\t' && rx % SCRIB_TAB_STOP != 0 && rx < end);
+	}
+	abAppend(ab, buf, len);
+}
+
+
 //Write a welcome message at 1/3 of the screen
 //draw tildas at the beginning of every row except welcome msg line
 //no of rows is obtained by getWindowSize and stored in E.screenrows
 void editorDrawRows(struct abuf *ab) {
 	int y;
+	erow *row = NULL;
+	int left = 0;
 
-	//go row by row and display each row by appending into ab 
+	//go row by row, each row is built in ab and then put into the frame
 	for (y = 0; y < E.screenrows; y++) {
+		ab->len = 0;
 		
 		//to enable scrolling and start display from top row visible on scroll
 		int filerow = y + E.rowoff;
@@ -810,46 +5745,42 @@ void editorDrawRows(struct abuf *ab) {
 		}
 		else {  //drawing a row that contains text
 
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-
-			//if length of E.row is longer than total coloumns, truncate
-			if (len > E.screencols) len = E.screencols;
-
-			//write E.row to text buffer for display
-			abAppend(ab, &E.row[filerow].render[E.coloff], len);
+			//visible rows are consecutive, so reuse the leaf they sit in
+			if (left == 0)
+				left = editorRowSpan(filerow, &row);
+			//write row to text buffer for display
+			editorDrawRow(ab, row);
+			row++;
+			left--;
 		}
 	
-		abAppend(ab, "\x1b[K", 3);
-			abAppend(ab, "\r\n", 2);
+		frameSetRow(&E.frame, y, ab->b, ab->len, 0);
 	}
 }
 
-//refresh screen line by line rather than entire screen
+//build the new screen in E.frame and send only what changed on the terminal
 void editorRefreshScreen() {
 
+	E.lastframe = editorNow();
+	profPush(PROF_SCROLL);
 	editorScroll();
+	profPop();
 
-	struct abuf ab = ABUF_INIT;
-
-	abAppend(&ab, "\x1b[?25l", 6);//hide the cursor
-	//abAppend(&ab, "\x1b[2J", 4); //clear entire screen
-	abAppend(&ab, "\x1b[H", 3);  //reposition cursor to top left corner
+	struct abuf ab = ABUF_INIT;	//scratch line the bars and rows are built in
 
+	profPush(PROF_DRAW);
+	frameResize(&E.frame, E.screenrows + 2, E.screencols);
+	E.frame.rowoff = E.rowoff;
 	editorDrawRows(&ab); //draw tildas
 	editorDrawStatusBar(&ab);//draw status bar
 	editorDrawMessageBar(&ab);//draw message bar
-
-	//move cursor to position stored in cx,cy
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-											(E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
-
-	abAppend(&ab, "\x1b[?25h", 6); //show the cursor
-
-	write(STDOUT_FILENO, ab.b, ab.len);
 	abFree(&ab);
+	profPop();
+
+	//leave the cursor at the position stored in cx,cy
+	profPush(PROF_WRITE);
+	editorFlushFrame(E.screenrows, E.cy - E.rowoff, E.rx - E.coloff);
+	profPop();
 }
 
 
@@ -880,6 +5811,32 @@ void editorSetStatusMessage(const char *fmt, ...) {
 /**************************** input *******************************/
 
 
+//pick up the new terminal size after a SIGWINCH
+void editorUpdateWindowSize() {
+	int rows, cols;
+	if (getWindowSize(&rows, &cols) == -1)
+		return;
+	E.screenrows = rows - 2;
+	E.screencols = cols;
+	//the terminal may have reflowed what it showed, start over
+	frameInvalidate(&E.shadow);
+}
+
+
+//the event timer went off, save if an autosave is due and sync the
+//journal. an expired status message only needs the redraw that follows
+void editorTimerEvent() {
+	if (E.jdirty && time(NULL) - E.jdirty >= JOURNAL_SYNC)
+		journalSync();
+	if (E.autosave > 0 && E.dirty && E.filename &&
+		time(NULL) - E.dirtytime >= E.autosave) {
+		E.dirtytime = time(NULL);	//if the save fails, retry later
+		if (E.save == NULL)
+			editorSave();
+	}
+}
+
+
 //to prompt the user for a filename to "Save as.." when no file name was specified
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
@@ -891,6 +5848,15 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     editorRefreshScreen();
     int c = editorReadKey();
 
+    //events only need a redraw, the callback is for keys
+    if (c == RESIZE_KEY || c == TIMER_KEY || c == SAVED_KEY || c == FOUND_KEY) {
+      if (c == RESIZE_KEY) editorUpdateWindowSize();
+      else if (c == TIMER_KEY) editorTimerEvent();
+      else if (c == SAVED_KEY) editorSaveDone();
+      else findCollect();
+      continue;
+    }
+
     //if del key is pressed while entering filename in input prompt
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       	if (buflen != 0) buf[--buflen] = '\0';
@@ -912,6 +5878,17 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       }
       buf[buflen++] = c;
       buf[buflen] = '\0';
+    } else if (c == PASTE_KEY) {	//a paste goes into the prompt minus its control chars
+      for (size_t i = 0; i < E.pastelen; i++) {
+        if (iscntrl((unsigned char)E.paste[i]) || E.paste[i] & 0x80)
+          continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = E.paste[i];
+      }
+      buf[buflen] = '\0';
     }
 
     if (callback) callback(buf, c);
@@ -922,7 +5899,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 //move the cursor with a,d,w,s
 void editorMoveCursor(int key) {
 
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
 	//if conditions prevent cursor from going out of window
 	switch (key) {
@@ -931,7 +5908,7 @@ void editorMoveCursor(int key) {
 			   E.cx--;
 			} else if (E.cy > 0) {
 				E.cy--;
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			}
 			break;
 		case ARROW_RIGHT:
@@ -948,6 +5925,7 @@ void editorMoveCursor(int key) {
 			}
 			break;
 		case ARROW_DOWN:
+			editorIndexRows(E.cy + 1);
 			 //let the cursor go below the window but not more than number of text lines present  
 			if (E.cy < E.numrows) {  
 			   E.cy++;  
@@ -955,7 +5933,7 @@ void editorMoveCursor(int key) {
 			break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 	int rowlen = row ? row->size : 0;
 	if (E.cx > rowlen) {
 	  E.cx = rowlen;
@@ -963,11 +5941,11 @@ void editorMoveCursor(int key) {
 }
 
 
-//read a key from terminal using editorReadKey() and handle it
-void editorProcessKeypress() {
+//handle a key or event editorReadKey returned
+void editorHandleKey(int c) {
 
 	static int quit_times = KILO_QUIT_TIMES;	
-  	int c = editorReadKey();
+  	undoStep(c);
 
   	switch (c) {
 
@@ -978,6 +5956,9 @@ void editorProcessKeypress() {
 	
 		//quit when ctrl-q is pressed 
 		case CTRL_KEY('q'): 
+
+			//let a save in progress finish first
+			editorSaveDone();
 	
 			//clear the screen and exit
 			//warn if unsaved changes and quit anyway if ctrl+q pressed 3 times
@@ -989,8 +5970,10 @@ void editorProcessKeypress() {
         		quit_times--;
         		return;
       		}
-      		write(STDOUT_FILENO, "\x1b[2J", 4);
-      		write(STDOUT_FILENO, "\x1b[H", 3);
+      		journalDiscard();
+      		triStop();	//not to leave a cache half written
+      		editorWrite("\x1b[2J", 4);
+      		editorWrite("\x1b[H", 3);
       		exit(0);
       		break;
 	
@@ -1005,7 +5988,15 @@ void editorProcessKeypress() {
 	
 		case END_KEY:
 			if (E.cy < E.numrows)
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
+			break;
+
+		case CTRL_KEY('z'):
+			editorUndo(0);
+			break;
+
+		case CTRL_KEY('y'):
+			editorUndo(1);
 			break;
 
 		//SEARCH
@@ -1024,6 +6015,9 @@ void editorProcessKeypress() {
 		case PAGE_UP:
 		case PAGE_DOWN:
 		{
+			//keys are handled several to a frame, bring rowoff up to
+			//date with the cursor as a redraw would have
+			editorScroll();
 	
 			if (c == PAGE_UP) {
 				E.cy = E.rowoff;
@@ -1047,7 +6041,48 @@ void editorProcessKeypress() {
 			editorMoveCursor(c);
 			break;
 	
+		//repaint the whole screen in case it got garbled
 		case CTRL_KEY('l'):
+			frameInvalidate(&E.shadow);
+			break;
+
+		//show where the time goes in place of the status message
+		case CTRL_KEY('p'):
+			E.prof.show = !E.prof.show;
+			break;
+
+		//and the memory, which also goes to SCRIB_MEMSTAT
+		case CTRL_KEY('g'):
+		{
+			char buf[sizeof(E.statusmsg)];
+			memReport(buf, sizeof(buf));
+			editorSetStatusMessage("%s", buf);
+			memDumpFile();
+		}
+		break;
+
+		//pasted text goes in as one edit and one redraw
+		case PASTE_KEY:
+			editorInsertText(E.paste, E.pastelen);
+			break;
+
+		//events rather than keys, they must not reset quit_times
+		case RESIZE_KEY:
+			editorUpdateWindowSize();
+			return;
+
+		case TIMER_KEY:
+			editorTimerEvent();
+			return;
+
+		case SAVED_KEY:
+			editorSaveDone();
+			return;
+
+		case FOUND_KEY:
+			findCollect();
+			return;
+
     	case '\x1b':
     	  	break;
 	
@@ -1062,9 +6097,273 @@ void editorProcessKeypress() {
 }
 
 
+//read a key from terminal using editorReadKey() and handle it
+void editorProcessKeypress() {
+	profPush(PROF_INPUT);
+	int c = editorReadKey();
+	profPop();
+	profPush(PROF_EDIT);
+	editorHandleKey(c);
+	profPop();
+}
+
+
+//handle keys until it is time to redraw. the first key is waited for,
+//then whatever else has been typed is taken too, along with anything
+//arriving before the frame budget is up, so keys typed faster than the
+//screen can be drawn never queue up behind redraws
+void editorProcessKeys() {
+	editorProcessKeypress();
+
+	long long start = editorNow();
+	while (1) {
+		long long now = editorNow();
+		long long due = E.lastframe + E.framebudget;
+		int wait = now < due ? (due - now + 999) / 1000 : 0;
+		//still redraw now and then when keys never stop coming
+		if (now - start >= FRAME_MAX_LAG || !editorInputPending(wait))
+			break;
+		editorProcessKeypress();
+	}
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/******************************* replay *******************************/
+
+//turn the escapes of a script line into the bytes they stand for, in
+//place: \e \r \n \t \\ and \xHH. returns the length left
+size_t replayUnescape(char *s) {
+	char *in = s, *out = s;
+	while (*in) {
+		if (*in != '\\' || in[1] == '\0') {
+			*out++ = *in++;
+			continue;
+		}
+		in++;
+		switch (*in) {
+			case 'e': *out++ = '\x1b'; break;
+			case 'r': *out++ = '\r'; break;
+			case 'n': *out++ = '\n'; break;
+			case 't': *out++ = '\t'; break;
+			case 'x':
+				if (isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+					char hex[3] = {in[1], in[2], '\0'};
+					*out++ = strtol(hex, NULL, 16);
+					in += 2;
+					break;
+				}
+				*out++ = *in;
+				break;
+			default: *out++ = *in; break;
+		}
+		in++;
+	}
+	return out - s;
+}
+
+
+//read a replay script. each line is 'label count keys', the keys being
+//sent count times over, or 'size rows cols' for the screen. blank lines
+//and lines starting with # are skipped
+struct replay *replayLoad(const char *path) {
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int lineno = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	struct replay *r = calloc(1, sizeof(struct replay));
+	if (r == NULL) die("calloc");
+	r->rows = 24;
+	r->cols = 80;
+	while ((linelen = getline(&line, &linecap, fp)) != -1) {
+		lineno++;
+		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+			line[--linelen] = '\0';
+		if (linelen == 0 || line[0] == '#')
+			continue;
+		if (strncmp(line, "size ", 5) == 0) {
+			if (sscanf(line + 5, "%d %d", &r->rows, &r->cols) != 2 || r->rows < 3 || r->cols < 1) {
+				fprintf(stderr, "%s:%d: expected 'size rows cols'\n", path, lineno);
+				exit(1);
+			}
+			continue;
+		}
+
+		char *sp = strchr(line, ' '), *end = NULL;
+		long count = sp ? strtol(sp + 1, &end, 10) : 0;
+		if (count < 1 || count > INT_MAX || *end != ' ' || end[1] == '\0') {
+			fprintf(stderr, "%s:%d: expected 'label count keys'\n", path, lineno);
+			exit(1);
+		}
+		*sp = '\0';
+		if (r->nop == r->cap) {
+			r->cap = r->cap ? r->cap * 2 : 16;
+			r->op = realloc(r->op, r->cap * sizeof(struct replayop));
+			if (r->op == NULL) die("realloc");
+		}
+		struct replayop *op = &r->op[r->nop++];
+		op->label = strdup(line);
+		op->keys = strdup(end + 1);
+		op->took = malloc(count * sizeof(long long));
+		if (op->label == NULL || op->keys == NULL || op->took == NULL)
+			die("malloc");
+		op->len = replayUnescape(op->keys);
+		op->count = count;
+		op->drawn = 0;
+	}
+	free(line);
+	fclose(fp);
+	return r;
+}
+
+
+//hand out keys of the op being sent, 0 once they have all been read
+int replayRead(char *buf, int len) {
+	struct replay *r = E.replay;
+	if ((size_t)len > r->left)
+		len = r->left;
+	memcpy(buf, r->next, len);
+	r->next += len;
+	r->left -= len;
+	return len;
+}
+
+
+//keep what would have gone to the terminal, it counts as frame memory
+void replaySink(const char *s, size_t len) {
+	struct replay *r = E.replay;
+	if (r->sinklen + len > r->sinkcap) {
+		size_t cap = r->sinkcap ? r->sinkcap * 2 : 64 * 1024;
+		while (cap < r->sinklen + len)
+			cap *= 2;
+		char *sink = memRealloc(MEM_FRAME, r->sink, cap);
+		if (sink == NULL) die("realloc");
+		r->sink = sink;
+		r->sinkcap = cap;
+	}
+	memcpy(r->sink + r->sinklen, s, len);
+	r->sinklen += len;
+}
+
+
+//the script left the editor waiting for something that won't come
+void replayFail(const char *msg) {
+	fprintf(stderr, "replay: %s\n", msg);
+	journalDiscard();
+	exit(1);
+}
+
+
+int replayCompare(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+//latency percentiles and throughput of each kind of op, the ops with
+//the same label are counted as one
+void replayReport() {
+	struct replay *r = E.replay;
+	int i, j, k;
+
+	printf("%-12s %9lld us\n", "open", r->open);
+	printf("%-12s %8s %10s %9s %9s %9s %9s %9s\n", "op", "count", "ops/s",
+		   "p50 us", "p90 us", "p99 us", "max us", "drawn/op");
+	for (i = 0; i < r->nop; i++) {
+		for (j = 0; j < i && strcmp(r->op[j].label, r->op[i].label) != 0; j++)
+			;
+		if (j < i)	//already reported
+			continue;
+		size_t n = 0, drawn = 0;
+		long long total = 0;
+		for (j = i; j < r->nop; j++)
+			if (strcmp(r->op[j].label, r->op[i].label) == 0)
+				n += r->op[j].count;
+		long long *all = malloc(n * sizeof(long long));
+		if (all == NULL) die("malloc");
+		n = 0;
+		for (j = i; j < r->nop; j++) {
+			if (strcmp(r->op[j].label, r->op[i].label) != 0)
+				continue;
+			for (k = 0; k < r->op[j].count; k++) {
+				all[n++] = r->op[j].took[k];
+				total += r->op[j].took[k];
+			}
+			drawn += r->op[j].drawn;
+		}
+		qsort(all, n, sizeof(long long), replayCompare);
+		//nearest rank
+		printf("%-12s %8zu %10.1f %9lld %9lld %9lld %9lld %9zu\n", r->op[i].label, n,
+			   total ? n * 1e6 / total : 0.0, all[(n * 50 + 99) / 100 - 1],
+			   all[(n * 90 + 99) / 100 - 1], all[(n * 99 + 99) / 100 - 1], all[n - 1], drawn / n);
+		free(all);
+	}
 
+	//what the workload left allocated and needed at most
+	printf("\n%-12s %12s %12s %10s\n", "memory", "now bytes", "peak bytes", "allocs");
+	for (i = 0; i < MEM_TAGS; i++)
+		printf("%-12s %12zu %12zu %10zu\n", memName[i], E.mem[i].cur, E.mem[i].peak,
+			   E.mem[i].allocs);
+	printf("%-12s %12zu\n%-12s %12zu\n", "mapped", E.maplen, "rss", memResident());
+}
 
 
+//run the script through the editor. each time an op's keys are sent is
+//timed from the first key to the redraw after the last one, a save or a
+//count of matches they start is waited for so that it counts in full.
+//then report and quit
+void replayRun() {
+	struct replay *r = E.replay;
+	int i, k;
+
+	//the first frame, as the main loop draws it before reading keys. it
+	//also indexes the rows on screen, the keys would otherwise find none
+	journalFlush();
+	editorRefreshScreen();
+	for (i = 0; i < r->nop; i++) {
+		struct replayop *op = &r->op[i];
+		for (k = 0; k < op->count; k++) {
+			long long start = editorNow();
+			r->next = op->keys;
+			r->left = op->len;
+			r->sinklen = 0;
+			while (r->left > 0 || E.inhead != E.intail)
+				editorProcessKeypress();
+			editorSaveDone();
+			findCollect();
+			journalFlush();
+			editorRefreshScreen();
+			op->took[k] = editorNow() - start;
+			op->drawn += r->sinklen;
+		}
+	}
+	replayReport();
+	findStop();
+	triStop();
+	journalDiscard();
+	exit(0);
+}
 
 
 
@@ -1087,13 +6386,63 @@ void initEditor() {
 	E.cy = 0;
 	E.rx = 0;
 	E.numrows = 0;
-	E.row = NULL;
+	E.rows = NULL;
 	E.dirty = 0;
 	E.rowoff = 0;
 	E.coloff = 0;
 	E.filename = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
+	E.map = NULL;
+	E.maplen = 0;
+	E.mapoff = 0;
+	E.mapfd = -1;
+	E.dirtyrow = INT_MAX;
+	E.gaprow = NULL;
+	E.gap = 0;
+	E.gaplen = 0;
+	memset(&E.text, 0, sizeof(E.text));
+	memset(&E.frame, 0, sizeof(E.frame));
+	memset(&E.shadow, 0, sizeof(E.shadow));
+	E.inhead = 0;
+	E.intail = 0;
+	E.paste = NULL;
+	E.pastelen = 0;
+	E.dirtytime = 0;
+	editorInitEvents();
+	profInit();
+	if (getenv("SCRIB_MEMSTAT"))
+		atexit(memDumpFile);
+
+	char *fps = getenv("SCRIB_FPS");
+	int rate = fps ? atoi(fps) : FRAME_RATE;
+	E.framebudget = rate > 0 ? 1000000 / rate : 0;
+	E.lastframe = 0;
+	E.syncsave = getenv("SCRIB_FSYNC") != NULL;
+	E.inplace = getenv("SCRIB_INPLACE") != NULL;
+	char *trimb = getenv("SCRIB_TRIGRAM_MB");
+	E.trimin = (size_t)(trimb ? atoi(trimb) : TRI_MIN_MB) << 20;
+	E.tricache = getenv("SCRIB_TRICACHE") != NULL;
+	E.tri = NULL;
+	E.save = NULL;
+	E.jpath = NULL;
+	E.jfd = -1;
+	E.jsize = 0;
+	E.jbuf = NULL;
+	E.jlen = 0;
+	E.jcap = 0;
+	E.jdirty = 0;
+	memset(&E.undo, 0, sizeof(E.undo));
+	memset(&E.redo, 0, sizeof(E.redo));
+	E.umem = 0;
+	char *undomb = getenv("SCRIB_UNDO_MB");
+	E.umax = (size_t)(undomb ? atoi(undomb) : UNDO_MAX_MB) << 20;
+	E.ubreak = UNDO_BREAK;
+	E.urec = 0;
+	E.uskip = 0;
+	E.utyped = 0;
+	E.findnocase = 0;
+	E.findword = 0;
 
 	//since it is passed by reference, 
 	//the values of E will be initialised with row and coloumn size of terminal
@@ -1113,18 +6462,33 @@ void initEditor() {
 ///////////////////////////////// MAIN ////////////////////////////
 int main(int argc, char *argv[]) {
 
-	enableRawMode();
+	//scrib --replay script [file] runs the keys of a script with no
+	//terminal and reports how long they took, see replayRun
+	int arg = 1;
+	if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+		E.replay = replayLoad(argv[2]);
+		arg = 3;
+	} else {
+		enableRawMode();
+	}
 	initEditor();
-	if (argc >= 2) {
-		editorOpen(argv[1]);
+	//set before opening, so news of a recovered journal wins
+	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+	if (argc > arg) {
+		long long start = editorNow();
+		editorOpen(argv[arg]);
+		if (E.replay)
+			E.replay->open = editorNow() - start;
 	}	
-
-	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+	if (E.replay)
+		replayRun();
 
 	while (1) {
 
+		//edits of the last frame go to the journal before being shown
+		journalFlush();
 		editorRefreshScreen();
-		editorProcessKeypress();
+		editorProcessKeys();
   	}
 	return 0;
 }